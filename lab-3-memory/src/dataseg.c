@@ -62,9 +62,28 @@
 // (i.e., to ds_start + PAGESIZE).
 //
 // The heap size can be adjusted by calling ds_sbrk(). The memory protection flags are set 
-// automatically whenever the ds_heap_brk pointer is adjusted.
+// automatically whenever the ds_heap_brk pointer is adjusted. By default, protection is lazy:
+// ds_sbrk() remembers the end of the accessible area (ds_prot_brk) and only calls mprotect() on
+// the pages between the old and the new end when brk crosses a page boundary. In eager mode
+// (ds_setlazymprotect(0)), every ds_sbrk() re-protects the entire data segment with two
+// mprotect() calls. ds_getnmprotect() returns the number of mprotect() calls.
 //
-// ds_heap_stat() can be used to retrieve information about the heap area.
+// ds_discard() returns the physical memory of the pages inside a range of the heap to the kernel
+// with madvise(MADV_DONTNEED) without moving brk; the pages read as zero when they are touched
+// again. ds_getnmadvise() returns the number of madvise() calls.
+//
+// ds_heap_stat() can be used to retrieve information about the heap area. ds_untouched() returns
+// the highest brk since ds_allocate(); memory above it has never been below brk and still reads as
+// zero. (brk moving down keeps the contents of the pages it leaves.)
+//
+// ds_allocate_huge() is a variant of ds_allocate() that backs the heap with huge pages to reduce
+// TLB misses on large heaps. It first tries explicit huge pages (MAP_HUGETLB; requires a huge
+// page pool, see /proc/sys/vm/nr_hugepages), then transparent huge pages (heap area aligned to
+// the huge page size and marked with madvise(MADV_HUGEPAGE)), and finally falls back to base
+// pages. Memory protection then works at huge page granularity: with explicit huge pages, the
+// guard areas and ds_getpagesize() are one huge page; with transparent huge pages, the accessible
+// area extends to the next huge page boundary after brk so that the kernel can map it with a huge
+// page. ds_getbacking() reports the backing that was obtained.
 //
 // ds_release() releases all memory and resets all internal variables. A subsequent call to
 // ds_allocate() is supported and initializes a 'fresh' heap.
@@ -87,12 +106,22 @@ static void *ds_end   = NULL;       ///< end of the data segment
 static void *ds_heap_start = NULL;  ///< start of the user space heap
 static void *ds_heap_brk   = NULL;  ///< current logical end of the user space heap
 static void *ds_heap_end   = NULL;  ///< end of the user space heap
+static void *ds_max_brk    = NULL;  ///< highest brk so far; memory above it was never below brk
 static int  PAGESIZE  = 0;          ///< (system) page size
 static int  ds_initialized = 0;     ///< initialized flag (yes: 1, otherwise 0)
 static int  ds_loglevel    = 0;     ///< log level (0: off; 1: info; 2: verbose)
 static int  ds_domprotect  = 1;     ///< mprotect() heap areas (0: off, 1: on)
 static ssize_t ds_num_sbrk = 0;     ///< number of times ds_sbrk() was called with a non-zero 
                                     ///< argument
+static DataSegmentBacking ds_backing = ds_BasePages; ///< backing of the data segment
+static size_t ds_protsize  = 0;     ///< granularity of memory protection (PAGESIZE or huge page size)
+static void *ds_prot_brk   = NULL;  ///< end of the read/write area (multiple of ds_protsize)
+static int  ds_lazymprotect = 1;    ///< mprotect() only pages that change (0: off, 1: on)
+static ssize_t ds_num_mprotect = 0; ///< number of mprotect() calls
+static ssize_t ds_num_madvise = 0;  ///< number of madvise(MADV_DONTNEED) calls by ds_discard()
+
+
+#define DS_HUGEPAGESIZE   (2*1024*1024) ///< huge page size if it cannot be determined
 
 
 /// @brief print a log message if level <= ds_loglevel. The variadic argument is a printf format
@@ -122,19 +151,56 @@ static void ds_log(int level, ...)
   #define LOG(level, ...)
 #endif
 
+/// @brief initialize the pointers of a freshly mapped data segment
+/// @param start start of the data segment
+/// @param ds_size size of the data segment, including the two guard areas
+/// @param pagesize page size (size of each guard area)
+/// @param protsize granularity of memory protection (multiple of @a pagesize)
+/// @param backing backing of the data segment
+static void ds_init(void *start, size_t ds_size, int pagesize, size_t protsize,
+                    DataSegmentBacking backing)
+{
+  // initalize pointers
+  PAGESIZE       = pagesize;
+  ds_protsize    = protsize;
+  ds_start       = start;
+  ds_end         = ds_start + ds_size;
+  ds_heap_start  = ds_start + PAGESIZE;
+  ds_heap_brk    = ds_heap_start;
+  ds_max_brk     = ds_heap_start;
+  ds_heap_end    = ds_end - PAGESIZE;
+  ds_prot_brk    = ds_heap_start;
+  ds_backing     = backing;
+  ds_initialized = 1;
+  ds_num_sbrk    = 0;
+  ds_num_mprotect = 0;
+  ds_num_madvise = 0;
+
+  LOG(2, "  ds_start:           %p\n"
+         "  ds_heap_start:      %p\n"
+         "  ds_heap_brk:        %p\n"
+         "  ds_heap_end:        %p\n"
+         "  ds_end:             %p\n"
+         "  PAGESIZE:           %d\n"
+         "  backing:            %s\n",
+         ds_start, ds_heap_start, ds_heap_brk, ds_heap_end, ds_end, PAGESIZE,
+         ds_backing == ds_HugeTLB ? "explicit huge pages" :
+         ds_backing == ds_TransparentHugePages ? "transparent huge pages" : "base pages");
+}
+
 void ds_allocate(size_t max_heap_size)
 {
   LOG(1, "ds_allocate(%lx)", max_heap_size);
 
   if (ds_start != NULL) ds_release();
 
-  PAGESIZE = getpagesize();
-  size_t ds_size = max_heap_size + 2*PAGESIZE;
+  int pagesize = getpagesize();
+  size_t ds_size = max_heap_size + 2*pagesize;
 
   // allocate memory for the data segment
   LOG(2, "  allocating %lx bytes of memory", ds_size);
-  ds_start = mmap(NULL, ds_size, PROT_NONE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_POPULATE, -1, 0);
-  if (ds_start == (void*)-1) {
+  void *start = mmap(NULL, ds_size, PROT_NONE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_POPULATE, -1, 0);
+  if (start == (void*)-1) {
     fprintf(stderr, "ERROR: cannot map memory in %s: %s.\n",
                     __func__, strerror(errno));
     exit(EXIT_FAILURE);
@@ -149,21 +215,91 @@ void ds_allocate(size_t max_heap_size)
   }
   */
 
-  // initalize pointers
-  ds_end         = ds_start + ds_size;
-  ds_heap_start  = ds_start + PAGESIZE;
-  ds_heap_brk    = ds_heap_start;
-  ds_heap_end    = ds_end - PAGESIZE;
-  ds_initialized = 1;
-  ds_num_sbrk    = 0;
+  ds_init(start, ds_size, pagesize, pagesize, ds_BasePages);
+}
 
-  LOG(2, "  ds_start:           %p\n"
-         "  ds_heap_start:      %p\n"
-         "  ds_heap_brk:        %p\n"
-         "  ds_heap_end:        %p\n"
-         "  ds_end:             %p\n"
-         "  PAGESIZE:           %d\n",
-         ds_start, ds_heap_start, ds_heap_brk, ds_heap_end, ds_end, PAGESIZE);
+
+/// @brief retrieve the system's (default) huge page size from /proc/meminfo
+/// @retval size_t huge page size in bytes
+static size_t ds_hugepagesize(void)
+{
+  size_t size = DS_HUGEPAGESIZE;
+  char line[128];
+
+  FILE *f = fopen("/proc/meminfo", "r");
+  if (f == NULL) return size;
+
+  while (fgets(line, sizeof(line), f) != NULL) {
+    unsigned long kb;
+    if (sscanf(line, "Hugepagesize: %lu kB", &kb) == 1) {
+      size = kb * 1024;
+      break;
+    }
+  }
+  fclose(f);
+
+  return size;
+}
+
+/// @brief check whether transparent huge pages can be requested with madvise()
+/// @retval 1 if THP are enabled in 'always' or 'madvise' mode
+/// @retval 0 otherwise
+static int ds_thp_enabled(void)
+{
+  char mode[128] = "";
+
+  FILE *f = fopen("/sys/kernel/mm/transparent_hugepage/enabled", "r");
+  if (f == NULL) return 0;
+  if (fgets(mode, sizeof(mode), f) == NULL) mode[0] = '\0';
+  fclose(f);
+
+  return strstr(mode, "[never]") == NULL && mode[0] != '\0';
+}
+
+void ds_allocate_huge(size_t max_heap_size)
+{
+  LOG(1, "ds_allocate_huge(%lx)", max_heap_size);
+
+  if (ds_start != NULL) ds_release();
+
+  int pagesize = getpagesize();
+  size_t hpsize = ds_hugepagesize();
+  size_t heap_size = (max_heap_size + hpsize - 1) / hpsize * hpsize;
+
+  // 1. explicit huge pages. Protection granularity is one huge page.
+  size_t ds_size = heap_size + 2*hpsize;
+  LOG(2, "  allocating %lx bytes of memory in explicit huge pages", ds_size);
+  void *start = mmap(NULL, ds_size, PROT_NONE,
+                     MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB|MAP_POPULATE, -1, 0);
+  if (start != (void*)-1) {
+    ds_init(start, ds_size, hpsize, hpsize, ds_HugeTLB);
+    return;
+  }
+  LOG(2, "  explicit huge pages not available: %s", strerror(errno));
+
+  // 2. transparent huge pages. Map enough to place the heap start at a huge page boundary, then
+  //    unmap the excess on both sides.
+  ds_size = heap_size + 2*pagesize;
+  size_t map_size = ds_size + hpsize;
+  void *map = mmap(NULL, map_size, PROT_NONE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_POPULATE, -1, 0);
+  if (map == (void*)-1) {
+    fprintf(stderr, "ERROR: cannot map memory in %s: %s.\n",
+                    __func__, strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+
+  void *heap = (void*)((((unsigned long)map + pagesize + hpsize - 1) / hpsize) * hpsize);
+  start = heap - pagesize;
+  if (start > map) munmap(map, start - map);
+  if (map + map_size > start + ds_size) munmap(start + ds_size, map + map_size - (start + ds_size));
+
+  if (ds_thp_enabled() && (madvise(heap, heap_size, MADV_HUGEPAGE) == 0)) {
+    ds_init(start, ds_size, pagesize, hpsize, ds_TransparentHugePages);
+  } else {
+    // 3. base pages (the aligned mapping is still valid)
+    LOG(2, "  transparent huge pages not available");
+    ds_init(start, ds_size, pagesize, pagesize, ds_BasePages);
+  }
 }
 
 
@@ -177,8 +313,10 @@ void ds_release(void)
     munmap(ds_start, ds_end-ds_start);
   }
 
-  ds_start = ds_end = ds_heap_start = ds_heap_brk = ds_heap_end = NULL;
+  ds_start = ds_end = ds_heap_start = ds_heap_brk = ds_heap_end = ds_prot_brk = NULL;
   PAGESIZE = 0;
+  ds_protsize = 0;
+  ds_backing = ds_BasePages;
   ds_initialized = 0;
 }
 
@@ -195,25 +333,49 @@ void* ds_sbrk(intptr_t increment)
     ds_num_sbrk++;
 
     if ((ds_heap_start <= ds_heap_brk) && (ds_heap_brk < ds_heap_end)) {
+      if (ds_heap_brk > ds_max_brk) ds_max_brk = ds_heap_brk;
+
       if (ds_domprotect) {
         // adjust memory access permissions
-        // since we are not forcing alignment of brk at PAGESIZE, we need to mark the invalid part
-        // before allowing access to the permissible area because permissions are set on a page-level
-        // basis
-        LOG(2, "  setting memory protection:\n"
-            "    READ/WRITE from %p to %p\n"
-            "    NO ACCESS  from %p to %p\n",
-            ds_heap_start, ds_heap_brk, ds_heap_brk, ds_end);
-
-        void *aligned_brk = (void*)(((unsigned long)ds_heap_brk) / PAGESIZE * PAGESIZE); // round down
-
-        if ((mprotect(aligned_brk, ds_end-aligned_brk, PROT_NONE) != 0) ||
-            (mprotect(ds_heap_start, ds_heap_brk-ds_heap_start, PROT_READ|PROT_WRITE) != 0))
-        {
+        // since we are not forcing alignment of brk at PAGESIZE and permissions are set on a
+        // page-level basis, the page containing brk remains accessible. The accessible area
+        // extends to the next multiple of the protection granularity.
+        void *aligned_brk = (void*)(((unsigned long)ds_heap_brk + ds_protsize - 1) / ds_protsize * ds_protsize); // round up
+        int res = 0;
+
+        if (!ds_lazymprotect) {
+          LOG(2, "  setting memory protection:\n"
+              "    READ/WRITE from %p to %p\n"
+              "    NO ACCESS  from %p to %p\n",
+              ds_heap_start, aligned_brk, aligned_brk, ds_end);
+
+          res = mprotect(aligned_brk, ds_end-aligned_brk, PROT_NONE) ||
+                mprotect(ds_heap_start, aligned_brk-ds_heap_start, PROT_READ|PROT_WRITE);
+          ds_num_mprotect += 2;
+        } else if (aligned_brk > ds_prot_brk) {
+          // brk moved into new pages: grant access to these pages only
+          LOG(2, "  setting memory protection:\n"
+              "    READ/WRITE from %p to %p\n",
+              ds_prot_brk, aligned_brk);
+
+          res = mprotect(ds_prot_brk, aligned_brk-ds_prot_brk, PROT_READ|PROT_WRITE);
+          ds_num_mprotect++;
+        } else if (aligned_brk < ds_prot_brk) {
+          // brk moved out of pages: revoke access to these pages only
+          LOG(2, "  setting memory protection:\n"
+              "    NO ACCESS  from %p to %p\n",
+              aligned_brk, ds_prot_brk);
+
+          res = mprotect(aligned_brk, ds_prot_brk-aligned_brk, PROT_NONE);
+          ds_num_mprotect++;
+        }
+
+        if (res != 0) {
           fprintf(stderr, "ERROR: cannot set memory protection flags in %s: %s.\n", 
               __func__, strerror(errno));
           exit(EXIT_FAILURE);
         }
+        ds_prot_brk = aligned_brk;
       }
     } else {
       // ignore increment and signal an error if we ended up outside the simulated data segment
@@ -228,6 +390,30 @@ void* ds_sbrk(intptr_t increment)
 }
 
 
+size_t ds_discard(void *addr, size_t length)
+{
+  LOG(1, "ds_discard(%p, 0x%lx)", addr, length);
+  assert(ds_initialized);
+
+  // only whole pages (huge pages if the segment is backed by them) inside the range and below brk
+  // can be discarded
+  void *start = (void*)(((unsigned long)addr + ds_protsize - 1) / ds_protsize * ds_protsize);
+  void *end = addr + length;
+  if (end > ds_heap_brk) end = ds_heap_brk;
+  end = (void*)((unsigned long)end / ds_protsize * ds_protsize);
+
+  if ((start < ds_heap_start) || (end <= start)) return 0;
+
+  ds_num_madvise++;
+  if (madvise(start, end-start, MADV_DONTNEED) != 0) {
+    LOG(1, "  madvise() failed: %s", strerror(errno));
+    return 0;
+  }
+
+  return end-start;
+}
+
+
 int ds_getpagesize(void)
 {
   assert(ds_initialized);
@@ -244,11 +430,32 @@ void ds_heap_stat(void **start, void **brk, void **end)
 }
 
 
+void* ds_untouched(void)
+{
+  return ds_max_brk;
+}
+
+
 ssize_t ds_getnsbrk(void)
 {
   return ds_num_sbrk;
 }
 
+ssize_t ds_getnmprotect(void)
+{
+  return ds_num_mprotect;
+}
+
+ssize_t ds_getnmadvise(void)
+{
+  return ds_num_madvise;
+}
+
+DataSegmentBacking ds_getbacking(void)
+{
+  return ds_backing;
+}
+
 void ds_setloglevel(int level)
 {
   ds_loglevel = level;
@@ -261,3 +468,9 @@ void ds_setmprotect(int active)
 }
 
 
+void ds_setlazymprotect(int active)
+{
+  ds_lazymprotect = (active > 0);
+}
+
+
@@ -36,11 +36,25 @@
 
 #include <unistd.h>
 
+/// @brief backing of the data segment
+typedef enum {
+  ds_BasePages,                   ///< base pages
+  ds_TransparentHugePages,        ///< transparent huge pages (madvise(MADV_HUGEPAGE))
+  ds_HugeTLB,                     ///< explicit huge pages (MAP_HUGETLB)
+} DataSegmentBacking;
+
 /// @brief initialize simulated data segment. Allocates & locks memory pages in RAM to minimize
 ///        performance variance.
 /// @param max_heap_size maximum possible size of heap data segment
 void ds_allocate(size_t max_heap_size);
 
+/// @brief initialize simulated data segment backed by huge pages. Tries explicit huge pages
+///        first, then transparent huge pages, and falls back to base pages. The heap size is
+///        rounded up to a multiple of the huge page size. Use ds_getbacking() to find out which
+///        backing was obtained.
+/// @param max_heap_size maximum possible size of heap data segment
+void ds_allocate_huge(size_t max_heap_size);
+
 /// @brief release simulated data segment
 void ds_release(void);
 
@@ -51,6 +65,14 @@ void ds_release(void);
 /// @retval (void*)-1 on error. errno is set to ENOMEM
 void* ds_sbrk(intptr_t increment);
 
+/// @brief return the physical memory of the heap pages that lie entirely inside the range
+///        [@a addr, @a addr + @a length) to the kernel (madvise(MADV_DONTNEED)). brk is not
+///        changed; the pages read as zero when they are accessed again.
+/// @param addr start of range
+/// @param length length of range in bytes
+/// @retval size_t number of bytes discarded
+size_t ds_discard(void *addr, size_t length);
+
 /// @brief retrieve pagesize of data segment
 /// @retval page size
 /// @retval 0 if not data segment not initialized)
@@ -63,10 +85,27 @@ int ds_getpagesize(void);
 /// @param[out] nsbrk number of times sbrk() was called with a non-zero argument
 void ds_heap_stat(void **start, void **brk, void **end);
 
+/// @brief retrieve the highest brk since the data segment was allocated. The heap above it has
+///        never been below brk and reads as zero (unless written to past brk).
+/// @retval void* highest brk
+void* ds_untouched(void);
+
 /// @brief retrieve the number of sbrk() was called with a non-zero argument
 /// @retval ssize_t number of sbrk() calls
 ssize_t ds_getnsbrk(void);
 
+/// @brief retrieve the number of mprotect() calls issued by ds_sbrk()
+/// @retval ssize_t number of mprotect() calls
+ssize_t ds_getnmprotect(void);
+
+/// @brief retrieve the number of madvise() calls issued by ds_discard()
+/// @retval ssize_t number of madvise() calls
+ssize_t ds_getnmadvise(void);
+
+/// @brief retrieve the backing of the data segment obtained by ds_allocate()/ds_allocate_huge()
+/// @retval DataSegmentBacking backing of the data segment
+DataSegmentBacking ds_getbacking(void);
+
 /// @brief set log level
 /// @brief level log level (0: no logging, 1: info; 2: verbose)
 void ds_setloglevel(int level);
@@ -75,4 +114,10 @@ void ds_setloglevel(int level);
 /// @brief active (1: mprotect() activated, 0: mprotect() not executed)
 void ds_setmprotect(int active);
 
+/// @brief turn lazy mprotect() on/off. In lazy mode (the default), ds_sbrk() only changes the
+///        protection of the pages that brk enters or leaves; otherwise, every ds_sbrk() re-
+///        protects the entire data segment. Must not be changed while mprotect() is turned off.
+/// @brief active (1: lazy mprotect(), 0: eager mprotect())
+void ds_setlazymprotect(int active);
+
 #endif // __DATSEG_H__
@@ -17,11 +17,19 @@
 // The data segment for the heap is provided by the dataseg module. A 'word' in the heap is
 // eight bytes.
 //
-// Implicit free list:
-// -------------------
-// - minimal block size: 32 bytes (header +footer + 2 data words)
+// Segregated explicit free lists:
+// -------------------------------
+// - block size granularity BS: 32 bytes (default) or 16 bytes. Selected at build time with
+//   MM_ALIGNMENT or before mm_init() with mm_setalignment().
+// - minimal block size: BS bytes. A free block needs 32 bytes (header + footer + 2 link words)
+//   to be linked into a free list; in 16-byte mode, 16-byte free blocks (fragments) are not
+//   listed and only reclaimed by coalescing with their neighbours.
 // - h,f: header/footer of free block
-// - H,F: header/footer of allocated block
+// - H:   header of allocated block. Allocated blocks carry no footer; the payload extends up to
+//        the header of the next block.
+// - n,p: next/prev pointers of free block (stored in the first two payload words)
+// - every header records the status of the preceding block in its PREV_ALLOC bit. Only the
+//   footer of a free block is ever read (to find its header when coalescing backwards).
 //
 // - state after initialization
 //
@@ -30,22 +38,214 @@
 //   ds_heap_start   |   heap_start                         heap_end       ds_heap_brk
 //               |   |   |                                         |       |
 //               v   v   v                                         v       v
-//               +---+---+-----------------------------------------+---+---+
-//               |???| F | h :                                 : f | H |???|
-//               +---+---+-----------------------------------------+---+---+
+//               +---+---+---+---+-----------------------------+---+---+---+
+//               |???| H | h | n | p :                       : f | H |???|
+//               +---+---+---+---+-----------------------------+---+---+---+
 //                       ^                                         ^
 //                       |                                         |
-//               32-byte aligned                           32-byte aligned
+//                BS-byte aligned                           BS-byte aligned
 //
-// - allocation policies: first, next, best fit
-// - block splitting: always at 32-byte boundaries
+// - free blocks are kept in NUM_CLASSES doubly-linked lists, one per power-of-two size class
+//   (class i holds blocks of size [BS<<i, BS<<(i+1)), the last class is unbounded). New free
+//   blocks are inserted at the head of their list (LIFO).
+// - allocation policies: first, next, best fit. All policies only ever visit free blocks:
+//   - first fit: sufficient block with the lowest address (see below)
+//   - next fit:  starting in the smallest class that can hold the request, first block in list
+//                order that is large enough; each class resumes at the block following the last hit
+//   - best fit:  smallest sufficient block, lowest address among equal sizes (see below)
+// - block splitting: always at BS-byte boundaries, only if the remainder can be listed
 // - immediate coalescing upon free
 //
+// Best-fit tree:
+// --------------
+// Under the best-fit policy, free blocks are not kept in the segregated lists but in a treap
+// ordered by (size, address). The two link words of a free block hold its left and right child;
+// the heap priority of a node is a hash of its address and therefore needs no storage. Search,
+// insertion, and removal take O(log n) expected time. Since all free list updates (splitting,
+// coalescing, realloc, heap shrinking) go through fl_insert()/fl_remove(), which dispatch to the
+// index of the allocation policy, the tree is maintained on all these paths.
+//
+// First-fit tree:
+// ---------------
+// Under the first-fit policy, free blocks are kept in a treap ordered by address (priorities as
+// in the best-fit tree). Every node also records the size of the largest block in its subtree,
+// so the free block with the lowest address that is large enough is found in O(log n) expected
+// time without visiting allocated blocks; the placement is the same as that of a walk over all
+// blocks in address order. The link words hold 48-bit pointers; their upper 16 bits store the
+// subtree maximum in units of BS (low half in the left, high half in the right link word):
+//
+//   63          48 47                                                        0
+//   +-------------+-----------------------------------------------------------+
+//   | max[15:0]   |                   left child                              |  left link
+//   +-------------+-----------------------------------------------------------+
+//   | max[31:16]  |                   right child                             |  right link
+//   +-------------+-----------------------------------------------------------+
+//
+// With MM_VERIFY_FF, every first-fit decision is checked against such a walk.
+//
+// Deferred coalescing:
+// --------------------
+// Optionally (MM_DEFER_COALESCE at build time or mm_setdefercoalesce() before mm_init()), freed
+// blocks of up to QL_MAXBLOCK bytes are not coalesced but put into a quick list, one per block
+// size. They remain allocated in the heap (marked with the QUICK flag in the header) and are
+// linked through their first payload word. A request of the same block size takes the most
+// recently freed one without splitting. All quick-listed blocks are released and coalesced in
+// one sweep when an allocation finds no free block, or when they add up to more than QL_LIMIT
+// bytes.
+//
+// Heap trimming:
+// --------------
+// The free block at the end of the heap is returned to the data segment with hysteresis: it is
+// trimmed when it reaches SHRINKTHLD bytes (high watermark), or when it exceeds TRIM_PAD bytes
+// and the heap has not grown for TRIM_DECAY heap operations. A trim keeps TRIM_PAD bytes (low
+// watermark) at the end of the heap, so that a workload oscillating at the top of the heap does
+// not move brk back and forth. The watermarks and the decay can be changed with mm_settrim().
+//
+// The heap grows in chunks of chunk_size bytes. The chunk size adapts to the workload: it doubles
+// (up to CHUNKMAX and 1/2^CHUNK_SHIFT of the heap) when the heap grows again within CHUNK_WINDOW
+// heap operations, and it is halved (down to CHUNKSIZE) by every trim and by a growth after a
+// long pause. A trailing free block left over from a large chunk does not count towards the high
+// watermark. The bounds can be changed with mm_setchunksize(); equal bounds give a fixed chunk
+// size.
+//
+// Optionally (MM_MADVISE at build time or mm_setmadvise() before mm_init()), brk is never moved
+// down. Instead, the pages of every coalesced free block of at least SHRINKTHLD bytes, except
+// its first TRIM_PAD bytes and its boundary tags, are released with ds_discard()
+// (madvise(MADV_DONTNEED)). This reduces the resident set also for free blocks in the interior
+// of the heap and keeps the address range.
+//
+// Statistics:
+// -----------
+// mm_stats() returns counters that are maintained as the heap changes: free bytes and free blocks
+// per size class (fl_insert()/fl_remove()), splits, coalesces, heap growth and trims, and the
+// number of blocks visited per free block search. mm_check() recounts the free blocks and bytes.
+//
+// With MM_INSTRUMENT, every free block search is additionally recorded in a two-dimensional log2
+// histogram per allocation policy: blocks visited over the number of free blocks at the time of
+// the search. A search length that grows with the number of free blocks shows up as a diagonal.
+// The histograms, with the number of searches, the total and the maximal number of visits, are
+// written at exit to the file named by the environment variable MM_INSTRUMENT_OUT (JSON if the
+// name ends in .json, CSV otherwise) or as CSV to stderr.
+//
+// Heap profiler:
+// --------------
+// Optionally (MM_PROFILE at build time or mm_setprofile() before mm_init()), allocations are
+// sampled as in tcmalloc's heap profiler: on average one sample every prof_interval allocated
+// bytes, with exponentially distributed gaps, so that an allocation of s bytes is sampled with
+// probability 1 - e^(-s/interval). A sample records the call stack (backtrace()) and lives in a
+// hash table keyed by the payload (allocated with the C library, not on this heap) until the
+// block is freed. mm_profile_dump() writes the live samples as folded stacks with estimated bytes
+// (flame graph input) or as a legacy pprof heap profile.
+//
+// Slab allocator:
+// ---------------
+// Optionally (MM_SLAB at build time or mm_setslab() before mm_init()), requests of up to SLAB_MAX
+// bytes are served from slabs: SLAB_SIZE-aligned regions carved out of regular allocated heap
+// blocks and divided into slots of 16, 32, 48, or 64 bytes. Free slots are tracked in a bitmap in
+// the slab header; a slab whose slots are all free is returned to the heap.
+//
+//        allocated heap block holding a slab
+//   +---+-----+--------------+------+------+-- ... --+------+---+
+//   | H | ... | slab header  | slot | slot |         | slot | H |  next block
+//   +---+-----+--------------+------+------+-- ... --+------+---+
+//             ^                                             ^
+//             |                                             |
+//      SLAB_SIZE aligned                           SLAB_SIZE aligned
+//
+// A bitmap with one bit per SLAB_SIZE unit of the data segment (slab_map) marks the units that
+// hold a slab. Since no other payload can start within such a unit, mm_free()/mm_realloc() can
+// tell slot pointers apart from regular blocks in O(1).
+//
+// Realloc slack:
+// --------------
+// Optionally (MM_REALLOC_SLACK at build time or mm_setreallocslack() before mm_init()), a block
+// that grows through mm_realloc() is over-allocated so that the next few growth steps fit into
+// the block and only require a header update. The unused tail (slack, in units of BS) and the
+// number of growth steps so far are kept in the otherwise unused high bits of the header:
+//
+//   63     60 59          48 47                                     4  3  2  1  0
+//   +--------+--------------+----------------------------------------+--+--+--+--+
+//   | growth |    slack     |               block size               |  |  | P| A|
+//   +--------+--------------+----------------------------------------+--+--+--+--+
+//
+// The slack grows geometrically with the number of growth steps (1/8, 1/4, 1/2, then 1x the
+// requested size). mm_shrink_to_fit() gives the slack back.
+//
+// Aligned allocation:
+// -------------------
+// mm_memalign() and mm_aligned_alloc() search for a free block that can hold the request at an
+// aligned address (alloc_aligned()). The block starts at the last BS boundary before the aligned
+// payload; the misaligned leading part of the free block is split off and stays free if it is
+// large enough to be listed, so no memory is lost to over-allocation. If the aligned payload
+// does not directly follow the header, the word preceding it holds a pseudo header with the
+// offset to the block header. The pseudo header has ALLOC cleared and ALIGNED set, which tells
+// it apart from the header of an allocated (ALLOC set) or a free block (ALIGNED/QUICK cleared):
+//
+//   +---+-----+---+---------------------------------+---+
+//   | H | ... | o | aligned payload                 | H |  next block
+//   +---+-----+---+---------------------------------+---+
+//   ^             ^
+//   |             |
+//   |   align-byte aligned, o = offset from H | ALIGNED
+//   BS-byte aligned
+//
+// mm_free() and mm_realloc() find the block header through payload_hdr(). A realloc keeps the
+// payload in place (and aligned) as long as it fits into the block or the block can be grown in
+// place; otherwise, the data moves to a regular block.
+//
+// Known-zero memory:
+// ------------------
+// Memory that enters the heap for the first time comes from an anonymous mapping and is zero. A
+// free block whose payload is known to be zero, apart from its link words and its footer,
+// carries the ZERO flag (bit 63 of the header; allocated headers use this bit for the growth
+// count). The flag is set on the initial block of a fresh data segment and on blocks added by
+// extend_heap() above zero_mark, the highest end the heap has ever had. The flag is inherited
+// by the remainder of a split and by the parts of an aligned split. Coalescing keeps the flag
+// if all merged blocks have it; it then clears the boundary tags and link words in between.
+// Blocks freed by the application are not known to be zero. mm_calloc() only clears the link
+// words and the footer of a known-zero block instead of the whole payload.
+//
+// Bulk operations:
+// ----------------
+// mm_malloc_bulk() allocates N blocks of the same size with one search of the free block index
+// for a run of N blocks, which is then carved into N ordinary allocated blocks (the last one
+// splits off the rest of the run). mm_free_bulk() sorts the pointers by address and releases each
+// run of adjacent blocks as one block, so that it is coalesced with its free neighbours once.
+//
+// Size queries and sized deallocation:
+// ------------------------------------
+// mm_usable_size() returns the number of bytes from the payload to the end of its block (or
+// slot). Since the caller may now use all of them, the realloc slack of the block is dropped so
+// that a later realloc() copies the whole block. mm_free_sized() takes the size the caller knows;
+// in thread-safe mode, it selects the thread cache bin from that size instead of the header. With
+// MM_VERIFY_SIZE, both check that the payload belongs to an allocated block and that the size
+// passed to mm_free_sized() does not exceed the part of the block in use.
+//
+// Thread safety:
+// --------------
+// In thread-safe mode (MM_THREADSAFE at build time or mm_setthreadsafe() before mm_init()), all
+// heap operations are serialized by a global heap lock. In front of it, every thread keeps a
+// cache of recently freed blocks (TC_BINS bins of up to TC_COUNT blocks each, one bin per block
+// size up to TC_MAXBLOCK bytes and one per slot size). Cached blocks remain allocated in the
+// heap; they are linked through their first payload word. A malloc() that hits the cache and
+// a free() that finds room in it do not take the heap lock. The caches of exiting threads are
+// returned to the heap, and mm_init() invalidates all caches by bumping a generation counter.
+//
+// Arenas:
+// -------
+// An arena hands out memory by bumping a pointer through a list of chunks. The chunks are
+// ordinary heap blocks obtained with mm_malloc(). Objects are never freed individually;
+// mm_arena_reset() rewinds the arena to its first chunk in O(1) and keeps all chunks for reuse,
+// and mm_arena_destroy() returns the chunks to the heap.
+//
 
 #define _GNU_SOURCE
 
 #include <assert.h>
 #include <error.h>
+#include <execinfo.h>
+#include <math.h>
+#include <pthread.h>
 #include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -59,15 +259,94 @@
 
 /// @name global variables
 /// @{
+#ifndef MM_ALIGNMENT
+  #define MM_ALIGNMENT     32                          ///< default block size granularity (16 or 32)
+#endif
+#ifndef MM_SLAB
+  #define MM_SLAB          0                           ///< default slab front-end setting (0: off, 1: on)
+#endif
+#ifndef MM_THREADSAFE
+  #define MM_THREADSAFE    0                           ///< default thread-safe mode (0: off, 1: on)
+#endif
+#ifndef MM_REALLOC_SLACK
+  #define MM_REALLOC_SLACK 0                           ///< default realloc slack mode (0: off, 1: on)
+#endif
+#ifndef MM_DEFER_COALESCE
+  #define MM_DEFER_COALESCE 0                          ///< default deferred coalescing mode (0: off, 1: on)
+#endif
+#ifndef MM_MADVISE
+  #define MM_MADVISE       0                           ///< default trimming mode (0: move brk, 1: madvise)
+#endif
+#ifndef MM_PROFILE
+  #define MM_PROFILE       0                           ///< default heap profile sampling interval in bytes (0: off)
+#endif
+#ifndef MM_INSTRUMENT
+  #define MM_INSTRUMENT    0                           ///< record search length histograms and dump them at exit (0: off, 1: on)
+#endif
+#ifndef MM_VERIFY_FF
+  #define MM_VERIFY_FF     0                           ///< check first-fit decisions against a heap walk (0: off, 1: on)
+#endif
+#ifndef MM_VERIFY_SIZE
+  #define MM_VERIFY_SIZE   0                           ///< check payloads and sizes passed to mm_usable_size()/mm_free_sized() (0: off, 1: on)
+#endif
+#define NUM_CLASSES        MM_NUM_CLASSES              ///< number of segregated free list size classes
+
 static void *ds_heap_start = NULL;                     ///< physical start of data segment
 static void *ds_heap_brk   = NULL;                     ///< physical end of data segment
 static void *heap_start    = NULL;                     ///< logical start of heap
 static void *heap_end      = NULL;                     ///< logical end of heap
+static void *zero_mark     = NULL;                     ///< the heap has never been written at or above this address
 static int  PAGESIZE       = 0;                        ///< memory system page size
+static size_t BS           = MM_ALIGNMENT;             ///< block size granularity & alignment. Must be a power of 2
+static size_t next_bs      = MM_ALIGNMENT;             ///< BS to be used by the next mm_init()
+static int  use_slab       = MM_SLAB;                  ///< slab front-end active (yes: 1, otherwise 0)
+static int  next_use_slab  = MM_SLAB;                  ///< use_slab for the next mm_init()
+static int  thread_safe    = MM_THREADSAFE;            ///< thread-safe mode active (yes: 1, otherwise 0)
+static int  next_thread_safe = MM_THREADSAFE;          ///< thread_safe for the next mm_init()
+static int  realloc_slack  = MM_REALLOC_SLACK;         ///< over-allocate growing blocks (yes: 1, otherwise 0)
+static int  next_realloc_slack = MM_REALLOC_SLACK;     ///< realloc_slack for the next mm_init()
+static int  defer_coalesce = MM_DEFER_COALESCE;        ///< keep freed small blocks in quick lists (yes: 1, otherwise 0)
+static int  next_defer_coalesce = MM_DEFER_COALESCE;   ///< defer_coalesce for the next mm_init()
+static int  use_madvise    = MM_MADVISE;               ///< release free pages with madvise instead of brk (yes: 1, otherwise 0)
+static int  next_use_madvise = MM_MADVISE;             ///< use_madvise for the next mm_init()
+static size_t prof_interval = MM_PROFILE;              ///< heap profile sampling interval in bytes (0: off)
+static size_t next_prof_interval = MM_PROFILE;         ///< prof_interval for the next mm_init()
+static pthread_mutex_t heap_lock = PTHREAD_MUTEX_INITIALIZER; ///< serializes heap operations in thread-safe mode
+static unsigned long mm_generation = 0;                ///< incremented by mm_init() to invalidate thread caches
 static void *(*get_free_block)(size_t) = NULL;         ///< get free block for selected allocation policy
-static void *next_block    = NULL;                     ///< next block used by next-fit policy
+static void *free_list[NUM_CLASSES];                   ///< heads of the segregated free lists
+static void *next_block[NUM_CLASSES];                  ///< per-class rover used by next-fit policy
+static size_t sl_max[NUM_CLASSES];                     ///< size of a large (usually the largest) block per class
+static size_t sl_max_n[NUM_CLASSES];                   ///< lower bound of the number of listed blocks of size sl_max
+static void *bt_root       = NULL;                     ///< root of the best-fit tree
+static void *at_root       = NULL;                     ///< root of the first-fit (address-ordered) tree
+static void (*index_insert)(void*) = NULL;             ///< insert free block into index of allocation policy
+static void (*index_remove)(void*) = NULL;             ///< remove free block from index of allocation policy
+static AllocationPolicy policy = ap_FirstFit;          ///< allocation policy
+static MMStats stats;                                  ///< heap statistics (see mm_stats())
+static unsigned long search_visits = 0;                ///< blocks visited by the current free block search
+#if MM_INSTRUMENT
+static unsigned long ins_nfree = 0;                    ///< number of free blocks
+static unsigned long ins_hist[3][MM_SEARCH_BINS][MM_SEARCH_BINS]; ///< searches per policy by free blocks & blocks visited
+static unsigned long ins_nsearch[3];                   ///< searches per policy
+static unsigned long ins_visits[3];                    ///< blocks visited per policy
+static unsigned long ins_maxvisits[3];                 ///< longest search per policy
+static int ins_registered = 0;                         ///< ins_dump() registered with atexit() (yes: 1, otherwise 0)
+#endif
 static size_t CHUNKSIZE    = 1<<10;                    ///< minimal data segment allocation unit (adjust to tune performance)
-static size_t SHRINKTHLD   = 1<<10;                    ///< threshold to shrink heap (implementation optional; adjust to tune performance)
+static size_t CHUNKMAX     = 1<<20;                    ///< maximal data segment allocation unit
+static int  CHUNK_SHIFT    = 3;                        ///< the chunk size grows to at most 1/2^CHUNK_SHIFT of the heap
+static unsigned long CHUNK_WINDOW = 1<<8;              ///< heap operations between growths that double the chunk size
+static size_t next_chunksize = 1<<10;                  ///< CHUNKSIZE for the next mm_init()
+static size_t next_chunkmax  = 1<<20;                  ///< CHUNKMAX for the next mm_init()
+static size_t chunk_size   = 1<<10;                    ///< current data segment allocation unit (CHUNKSIZE..CHUNKMAX)
+static size_t SHRINKTHLD   = 1<<16;                    ///< threshold to shrink heap (high watermark; adjust to tune performance)
+static size_t TRIM_PAD     = 1<<14;                    ///< free bytes kept at the end of the heap by a trim (low watermark)
+static unsigned long TRIM_DECAY = 1<<10;               ///< heap operations without growth after which the heap is trimmed to TRIM_PAD
+static size_t next_shrinkthld = 1<<16;                 ///< SHRINKTHLD for the next mm_init()
+static size_t next_trim_pad   = 1<<14;                 ///< TRIM_PAD for the next mm_init()
+static unsigned long next_trim_decay = 1<<10;          ///< TRIM_DECAY for the next mm_init()
+static unsigned long trim_age = 0;                     ///< heap operations since the heap last grew or was trimmed
 static int  mm_initialized = 0;                        ///< initialized flag (yes: 1, otherwise 0)
 static int  mm_loglevel    = 0;                        ///< log level (0: off; 1: info; 2: verbose)
 /// @}
@@ -81,11 +360,18 @@ static int  mm_loglevel    = 0;                        ///< log level (0: off; 1
 
 #define ALLOC              1                           ///< block allocated flag
 #define FREE               0                           ///< block free flag
+#define PREV_ALLOC         2                           ///< previous block allocated flag (header only)
+#define QUICK              4                           ///< block is in a quick list (header of allocated block only)
+#define ALIGNED            4                           ///< pseudo header of an aligned payload (with ALLOC cleared)
+#define ZERO               ((TYPE)1 << 63)             ///< payload of free block is known to be zero (header of free block only)
 #define STATUS_MASK        ((TYPE)(0x7))               ///< mask to retrieve flagsfrom header/footer
-#define SIZE_MASK          (~STATUS_MASK)              ///< mask to retrieve size from header/footer
+#define SLACK_SHIFT        48                          ///< position of slack field in header of allocated block
+#define GROWTH_SHIFT       60                          ///< position of growth count in header of allocated block
+#define SLACK_MAX          ((TYPE)0xfff)               ///< largest slack (in units of BS)
+#define GROWTH_MAX         ((TYPE)0xf)                 ///< largest growth count
+#define SIZE_MASK          ((((TYPE)1 << SLACK_SHIFT) - 1) & ~STATUS_MASK) ///< mask to retrieve size from header/footer
 
-#define BS                 32                          ///< minimal block size. Must be a power of 2
-#define BS_MASK            (~(BS-1))                   ///< alignment mask
+#define FREE_BS            (4*TYPE_SIZE)               ///< minimal size of a free block in a free list
 
 #define WORD(p)            ((TYPE)(p))                 ///< convert pointer to TYPE
 #define PTR(w)             ((void*)(w))                ///< convert TYPE to void*
@@ -101,8 +387,14 @@ static int  mm_loglevel    = 0;                        ///< log level (0: off; 1
 
 #define PUT(p, v)          (*(TYPE*)(p) = (TYPE)(v))   ///< write word v to *p
 #define GET(p)             (*(TYPE*)(p))               ///< read word at *p
+#define GET_ATOMIC(p)      __atomic_load_n((TYPE*)(p), __ATOMIC_RELAXED)      ///< read word at *p (without heap lock)
 #define GET_SIZE(p)        (SIZE(GET(p)))              ///< extract size from header/footer
 #define GET_STATUS(p)      (STATUS(GET(p)))            ///< extract status from header/footer
+#define GET_ALLOC(p)       (GET(p) & ALLOC)            ///< extract allocated flag from header/footer
+#define GET_PREV_ALLOC(p)  (GET(p) & PREV_ALLOC)       ///< extract previous-allocated flag from header
+#define GET_SLACK(p)       ((GET(p) >> SLACK_SHIFT) & SLACK_MAX) ///< extract slack from header
+#define GET_GROWTH(p)      (GET(p) >> GROWTH_SHIFT)    ///< extract growth count from header
+#define GET_ZERO(p)        (GET(p) & ZERO)             ///< extract known-zero flag from header of free block
 
 
 //
@@ -110,6 +402,28 @@ static int  mm_loglevel    = 0;                        ///< log level (0: off; 1
 #define ROUND_UP(w)                     (((w)+BS-1)/BS*BS)                      ///< round up data
 #define NEXT_BLK(p)                     ((p) + GET_SIZE(p))                     ///< find next block from header
 #define NEXT_BLK_FROM_PAYLOAD(p)        ((p) + GET_SIZE(PREV_PTR(p)))           ///< find next block from payload
+#define NEXT_FREE(p)                    (*(void**)NEXT_PTR(p))                  ///< next free block (free block header)
+#define PREV_FREE(p)                    (*(void**)NEXT_PTR(NEXT_PTR(p)))        ///< previous free block (free block header)
+#define BT_LEFT(p)                      NEXT_FREE(p)                            ///< left child in best-fit tree (free block header)
+#define BT_RIGHT(p)                     PREV_FREE(p)                            ///< right child in best-fit tree (free block header)
+#define AT_PTR_MASK                     (((TYPE)1 << 48) - 1)                   ///< pointer bits of a first-fit tree link word
+#define ALIGN_UP(w, a)                  (((w)+(a)-1) & ~((TYPE)(a)-1))          ///< round up word w to power of 2 a
+#define ALIGN_DOWN(w, a)                ((w) & ~((TYPE)(a)-1))                  ///< round down word w to power of 2 a
+
+#define SLAB_SIZE                       (1<<12)                                 ///< size & alignment of a slab
+#define SLAB_CLASSES                    4                                       ///< number of slot sizes (16, 32, 48, 64)
+#define SLAB_MAX                        (16*SLAB_CLASSES)                       ///< largest request served from a slab
+
+#define TC_MAXBLOCK                     (1<<10)                                 ///< largest block kept in a thread cache
+#define TC_BINS                         (SLAB_CLASSES + TC_MAXBLOCK/16 + 1)     ///< number of thread cache bins
+#define TC_COUNT                        7                                       ///< maximal number of blocks per bin
+
+#define QL_MAXBLOCK                     (1<<9)                                  ///< largest block kept in a quick list
+#define QL_BINS                         (QL_MAXBLOCK/16 + 1)                    ///< number of quick lists
+#define QL_LIMIT                        (1<<16)                                 ///< total size of quick-listed blocks that triggers a sweep
+
+#define ARENA_CHUNK                     (1<<12)                                 ///< default arena chunk size
+#define ARENA_ALIGN                     16                                      ///< alignment of arena allocations
 //
 /// @}
 
@@ -175,321 +489,2340 @@ static void mm_panic(const char *func, ...)
 /// @}
 
 
-static void* ff_get_free_block(size_t);
-static void* nf_get_free_block(size_t);
-static void* bf_get_free_block(size_t);
+/// @name Free list management
+/// @{
 
-void mm_init(AllocationPolicy ap)
+/// @brief compute the size class of a block of @a size bytes
+/// @param size block size (including header & footer tags), in bytes
+/// @retval int index of free list holding blocks of this size
+static int size_class(size_t size)
 {
-  LOG(1, "mm_init()");
-  //
-  // set allocation policy
-  //
-  char *apstr;
-  switch (ap) {
-    case ap_FirstFit: get_free_block = ff_get_free_block; apstr = "first fit"; break;
-    case ap_NextFit:  get_free_block = nf_get_free_block; apstr = "next fit";  break;
-    case ap_BestFit:  get_free_block = bf_get_free_block; apstr = "best fit";  break;
-    default: PANIC("Invalid allocation policy.");
-  }
-  LOG(2, "  allocation policy       %s\n", apstr);
+  // class i holds blocks of [BS<<i, BS<<(i+1)); BS is a power of 2
+  int c = (int)(63 - __builtin_clzl(size) - __builtin_ctzl(BS));
+  return MIN(c, NUM_CLASSES-1);
+}
 
-  //
-  // retrieve heap status and perform a few initial sanity checks
-  //
-  ds_heap_stat(&ds_heap_start, &ds_heap_brk, NULL);
-  PAGESIZE = ds_getpagesize();
+/// @brief insert free block @a blk at the head of its size class list
+/// @param blk header of free block
+static void sl_insert(void *blk)
+{
+  int c = size_class(GET_SIZE(blk));
+
+  NEXT_FREE(blk) = free_list[c];
+  PREV_FREE(blk) = NULL;
+  if (free_list[c] != NULL) PREV_FREE(free_list[c]) = blk;
+  free_list[c] = blk;
+
+  if (GET_SIZE(blk) > sl_max[c]) {
+    sl_max[c] = GET_SIZE(blk);
+    sl_max_n[c] = 1;
+  } else if (GET_SIZE(blk) == sl_max[c]) {
+    sl_max_n[c]++;
+  }
+}
 
-  LOG(2, "  ds_heap_start:          %p\n"
-         "  ds_heap_brk:            %p\n"
-         "  PAGESIZE:               %d\n",
-         ds_heap_start, ds_heap_brk, PAGESIZE);
+/// @brief unlink free block @a blk from its size class list
+/// @param blk header of free block (the size in the header must still be the one it was
+///            inserted with)
+static void sl_remove(void *blk)
+{
+  int c = size_class(GET_SIZE(blk));
+  void *next = NEXT_FREE(blk);
+  void *prev = PREV_FREE(blk);
+
+  if (prev != NULL) NEXT_FREE(prev) = next;
+  else free_list[c] = next;
+  if (next != NULL) PREV_FREE(next) = prev;
+
+  // keep the next-fit rover on a block that is still in the list
+  if (next_block[c] == blk) next_block[c] = next;
+
+  // When the last block of size sl_max leaves, the largest remaining one is unknown without a
+  // list walk; fall back to the head of the list, which is within a factor of 2 of it (except in
+  // the open last class). Larger blocks raise sl_max again when they are inserted or visited.
+  if ((GET_SIZE(blk) == sl_max[c]) && (--sl_max_n[c] == 0)) {
+    sl_max[c] = (free_list[c] != NULL) ? GET_SIZE(free_list[c]) : 0;
+    sl_max_n[c] = (free_list[c] != NULL);
+  }
+}
 
-  if (ds_heap_start == NULL) PANIC("Data segment not initialized.");
-  if (ds_heap_start != ds_heap_brk) PANIC("Heap not clean.");
-  if (PAGESIZE == 0) PANIC("Reported pagesize == 0.");
+/// @brief tree order of free blocks: by size, then by address
+/// @retval 1 if block @a a precedes block @a b
+/// @retval 0 otherwise
+static inline int bt_less(void *a, void *b)
+{
+  size_t sa = GET_SIZE(a), sb = GET_SIZE(b);
+  return (sa < sb) || ((sa == sb) && (a < b));
+}
 
-  //
-  // initialize heap
-  //
+/// @brief treap priority of block @a blk (a hash of its address)
+static inline TYPE bt_prio(void *blk)
+{
+  return (WORD(blk) >> 4) * 0x9e3779b97f4a7c15UL;
+}
 
-  // SBRK as chuncksize
-  ds_sbrk(CHUNKSIZE);
-  ds_heap_stat(&ds_heap_start, &ds_heap_brk, NULL);
-  // Get pagesize
-  PAGESIZE = ds_getpagesize();
-  // Store heap start pointer and end pointer
-  heap_start = PTR((WORD(ds_heap_start) / BS + 1) * BS);
-  heap_end = PTR(WORD(ds_heap_brk - TYPE_SIZE) / BS * BS);
-  LOG(2, "After allocate heap       \n"
-        "  ds_heap_start:          %p\n"
-        "  ds_heap_brk:            %p\n"
-        "  PAGESIZE:               %d\n",
-        "  heap_start:             %p\n",
-        "  heap_end:               %p\n",
-        ds_heap_start, ds_heap_brk, PAGESIZE, heap_start, heap_end);
-  // pre heap block (Initial sentinel half block)
-  PUT(PREV_PTR(heap_start), PACK(0, ALLOC));
-  
-  // first free heap block (make header and footer for free block)
-  size_t initial_free_block_size = WORD(heap_end) - WORD(heap_start);
-  PUT(heap_start, PACK(initial_free_block_size, FREE));
-  PUT(PREV_PTR(heap_end), PACK(initial_free_block_size, FREE));
-  // post heap block (end sentinel half block)
-  PUT(heap_end, PACK(0, ALLOC));
+/// @brief merge treaps @a l and @a r (all blocks in @a l precede those in @a r)
+/// @retval void* root of the merged treap
+static void* bt_merge(void *l, void *r)
+{
+  void *root;
+  void **link = &root;
+
+  // walk down the right spine of l and the left spine of r, taking the higher priority first
+  while ((l != NULL) && (r != NULL)) {
+    if (bt_prio(l) > bt_prio(r)) {
+      *link = l;
+      link = &BT_RIGHT(l);
+      l = BT_RIGHT(l);
+    } else {
+      *link = r;
+      link = &BT_LEFT(r);
+      r = BT_LEFT(r);
+    }
+  }
+  *link = (l != NULL) ? l : r;
 
-  //
-  // heap is initialized
-  //
-  mm_initialized = 1;
+  return root;
 }
 
-
-void* mm_malloc(size_t size)
+/// @brief insert free block @a blk into the best-fit tree
+/// @param blk header of free block
+static void bt_insert(void *blk)
 {
-  LOG(1, "mm_malloc(0x%lx)", size);
+  TYPE prio = bt_prio(blk);
+  void **link = &bt_root;
 
-  assert(mm_initialized);
+  // descend to the position of blk in the heap order
+  while ((*link != NULL) && (bt_prio(*link) > prio)) {
+    link = bt_less(blk, *link) ? &BT_LEFT(*link) : &BT_RIGHT(*link);
+  }
 
-  // If size is zero, return null
-  if (size == 0) {
-    return NULL;
+  // split the subtree found there into the blocks preceding and following blk
+  void *t = *link;
+  void **l = &BT_LEFT(blk), **r = &BT_RIGHT(blk);
+  while (t != NULL) {
+    if (bt_less(t, blk)) {
+      *l = t;
+      l = &BT_RIGHT(t);
+      t = BT_RIGHT(t);
+    } else {
+      *r = t;
+      r = &BT_LEFT(t);
+      t = BT_LEFT(t);
+    }
   }
-  // Round up size as blocksize
-  size_t blocksize = ROUND_UP(TYPE_SIZE + size + TYPE_SIZE);
-  // Get free block pointer
-  void* free_block = get_free_block(blocksize);
+  *l = *r = NULL;
+  *link = blk;
+}
 
-  // When there's no free block, expand heap
-  if (free_block == NULL) { 
-    void *old_heap_end = heap_end;
-    void *new_heap_end;
+/// @brief remove free block @a blk from the best-fit tree
+/// @param blk header of free block (the size in the header must still be the one it was
+///            inserted with)
+static void bt_remove(void *blk)
+{
+  void **link = &bt_root;
 
-    // Decide how much to expand the heap by
-    size_t expand_size = MAX(CHUNKSIZE, blocksize);
+  while (*link != blk) {
+    if (*link == NULL) PANIC("Free block %p not in best-fit tree.", blk);
+    link = bt_less(blk, *link) ? &BT_LEFT(*link) : &BT_RIGHT(*link);
+  }
+  *link = bt_merge(BT_LEFT(blk), BT_RIGHT(blk));
+}
 
-    // Expand heap by expand_size
-    if (ds_sbrk(expand_size) == NULL) {
-      return NULL; // Expansion failed
+/// @brief find the smallest free block of at least @a size bytes in the best-fit tree. Among
+///        blocks of equal size, the one with the lowest address is returned.
+/// @param size size of block (including header & footer tags), in bytes
+/// @retval void* header of free block
+/// @retval NULL if no free block is large enough
+static void* bt_search(size_t size)
+{
+  // descend the tree and remember the last block that was large enough
+  void *best = NULL;
+  void *t = bt_root;
+  unsigned long visits = 0;
+  while (t != NULL) {
+    visits++;
+    if (GET_SIZE(t) >= size) {
+      best = t;
+      t = BT_LEFT(t);
+    } else {
+      t = BT_RIGHT(t);
     }
-    // Stroe ds heap start pointer and brk pointer
-    ds_heap_stat(&ds_heap_start, &ds_heap_brk, NULL);
-    // Get page size
-    PAGESIZE = ds_getpagesize();
-    new_heap_end = PTR(WORD(ds_heap_brk - TYPE_SIZE) / BS * BS);
+  }
+  search_visits += visits;
+  return best;
+}
 
-    // Update heap_end
-    heap_end = new_heap_end;
+/// @brief left child of block @a t in the first-fit tree
+static inline void* at_left(void *t)
+{
+  return PTR(GET(NEXT_PTR(t)) & AT_PTR_MASK);
+}
 
-    // Initialize the newly allocated block
-    size_t expanded_block_size = WORD(heap_end) - WORD(old_heap_end);
+/// @brief right child of block @a t in the first-fit tree
+static inline void* at_right(void *t)
+{
+  return PTR(GET(NEXT_PTR(NEXT_PTR(t))) & AT_PTR_MASK);
+}
 
-    // Check if old_heap_end is adjacent to a free block
-    void *prev_block = PREV_PTR(old_heap_end); // Get the footer of the previous block
-    if (GET_STATUS(prev_block) == FREE) { // If adjacent block is free, merge it
-      size_t prev_block_size = GET_SIZE(prev_block);
-      old_heap_end = PTR(WORD(old_heap_end) - prev_block_size);
-      expanded_block_size += prev_block_size;
-    }
-    // Store header and footer info
-    PUT(old_heap_end, PACK(expanded_block_size, FREE));
-    PUT(HDR2FTR(old_heap_end), PACK(expanded_block_size, FREE));
+/// @brief size of the largest block in the first-fit subtree rooted at @a t (0 if empty)
+static inline size_t at_max(void *t)
+{
+  if (t == NULL) return 0;
+  return ((GET(NEXT_PTR(t)) >> 48) | (GET(NEXT_PTR(NEXT_PTR(t))) >> 48 << 16)) * BS;
+}
 
-    // Update the post heap block (end sentinel)
-    PUT(heap_end, PACK(0, ALLOC));
+/// @brief set the children of block @a t in the first-fit tree and its subtree maximum @a max
+static inline void at_put(void *t, void *l, void *r, size_t max)
+{
+  TYPE m = max / BS;
+  PUT(NEXT_PTR(t), WORD(l) | ((m & 0xffff) << 48));
+  PUT(NEXT_PTR(NEXT_PTR(t)), WORD(r) | ((m >> 16) << 48));
+}
+
+/// @brief set the children of block @a t in the first-fit tree and recompute its subtree maximum
+static inline void at_set(void *t, void *l, void *r)
+{
+  at_put(t, l, r, MAX(GET_SIZE(t), MAX(at_max(l), at_max(r))));
+}
+
+/// @brief split the first-fit subtree @a t into the blocks below and above address @a blk
+/// @param[out] l, r roots of the two parts
+static void at_split(void *t, void *blk, void **l, void **r)
+{
+  if (t == NULL) {
+    *l = *r = NULL;
+  } else if (t < blk) {
+    void *a;
+    at_split(at_right(t), blk, &a, r);
+    at_set(t, at_left(t), a);
+    *l = t;
+  } else {
+    void *b;
+    at_split(at_left(t), blk, l, &b);
+    at_set(t, b, at_right(t));
+    *r = t;
+  }
+}
 
-    free_block = old_heap_end;
+/// @brief merge first-fit subtrees @a l and @a r (all blocks in @a l lie below those in @a r)
+/// @retval void* root of the merged subtree
+static void* at_merge(void *l, void *r)
+{
+  if (l == NULL) return r;
+  if (r == NULL) return l;
+
+  if (bt_prio(l) > bt_prio(r)) {
+    at_set(l, at_left(l), at_merge(at_right(l), r));
+    return l;
+  } else {
+    at_set(r, at_merge(l, at_left(r)), at_right(r));
+    return r;
   }
+}
 
-  // Get free block sizse
-  size_t free_block_size = GET_SIZE(free_block);
+/// @brief make @a c the left (if below @a t) or right child of block @a t in the first-fit tree,
+///        keeping the subtree maximum of @a t
+static inline void at_link(void *t, void *c)
+{
+  void *w = (c < t) ? NEXT_PTR(t) : NEXT_PTR(NEXT_PTR(t));
+  PUT(w, (GET(w) & ~AT_PTR_MASK) | WORD(c));
+}
 
-  // If free block size is bigger than block block size + 4 * type size
-  if (free_block_size >= blocksize + 4 * TYPE_SIZE) {
-    // Split block
-    PUT(free_block, PACK(blocksize, ALLOC));
-    PUT(HDR2FTR(free_block), PACK(blocksize, ALLOC));
-    void *remainder = NEXT_BLK(free_block);
-    PUT(remainder, PACK(free_block_size - blocksize, FREE));
-    PUT(HDR2FTR(remainder), PACK(free_block_size - blocksize, FREE));
-  } else { // It is better, merge small free block into allocate block
-    PUT(free_block, PACK(free_block_size, ALLOC));
-    PUT(HDR2FTR(free_block), PACK(free_block_size, ALLOC));
+/// @brief remove free block @a blk from the first-fit subtree @a t
+/// @retval void* new root of the subtree
+static void* at_remove_at(void *t, void *blk)
+{
+  if (t == NULL) PANIC("Free block %p not in first-fit tree.", blk);
+
+  if (t == blk) return at_merge(at_left(t), at_right(t));
+
+  // the subtree maximum of t can only drop if blk was the block defining it
+  int update = (GET_SIZE(blk) == at_max(t));
+  void *l = at_left(t), *r = at_right(t);
+  if (blk < t) {
+    void *c = at_remove_at(l, blk);
+    if ((c != l) || update) at_set(t, c, r);
+  } else {
+    void *c = at_remove_at(r, blk);
+    if ((c != r) || update) at_set(t, l, c);
   }
-  // Return payload pointer
-  return (free_block + TYPE_SIZE);
+  return t;
 }
 
-void* mm_calloc(size_t nmemb, size_t size)
+/// @brief insert free block @a blk into the first-fit tree
+/// @param blk header of free block
+static void at_insert(void *blk)
 {
-  LOG(1, "mm_calloc(0x%lx, 0x%lx)", nmemb, size);
+  TYPE prio = bt_prio(blk);
+  size_t size = GET_SIZE(blk);
+  void *parent = NULL, *t = at_root;
+
+  // descend to the position of blk in the heap order. The subtree maxima on the way can only
+  // grow.
+  while ((t != NULL) && (bt_prio(t) > prio)) {
+    void *l = at_left(t), *r = at_right(t);
+    if (size > at_max(t)) at_put(t, l, r, size);
+    parent = t;
+    t = (blk < t) ? l : r;
+  }
 
-  assert(mm_initialized);
+  // split the subtree found there into the blocks below and above blk
+  void *l, *r;
+  at_split(t, blk, &l, &r);
+  at_set(blk, l, r);
 
-  //
-  // calloc is simply malloc() followed by memset()
-  //
-  void *payload = mm_malloc(nmemb * size);
+  if (parent == NULL) at_root = blk;
+  else at_link(parent, blk);
+}
 
-  if (payload != NULL) memset(payload, 0, nmemb * size);
+/// @brief remove free block @a blk from the first-fit tree
+/// @param blk header of free block (the size in the header must still be the one it was
+///            inserted with)
+static void at_remove(void *blk)
+{
+  at_root = at_remove_at(at_root, blk);
+}
 
-  return payload;
+/// @brief find the free block with the lowest address that has at least @a size bytes in the
+///        first-fit tree
+/// @param size size of block (including header & footer tags), in bytes
+/// @retval void* header of free block
+/// @retval NULL if no free block is large enough
+static void* at_search(size_t size)
+{
+  void *t = at_root;
+  if (at_max(t) < size) return NULL;
+
+  // the subtree of t always contains a fit; prefer the left subtree, then t itself
+  unsigned long visits = 1;
+  for (;; visits++) {
+    void *l = at_left(t);
+    if (at_max(l) >= size) t = l;
+    else if (GET_SIZE(t) >= size) break;
+    else t = at_right(t);
+  }
+  search_visits += visits;
+  return t;
 }
 
-void* mm_realloc(void *ptr, size_t size)
+/// @brief insert free block @a blk into the free block index of the allocation policy.
+///        Fragments smaller than FREE_BS cannot hold the links and are not inserted.
+/// @param blk header of free block
+static void fl_insert(void *blk)
 {
-  LOG(1, "mm_realloc(%p, 0x%lx)", ptr, size);
+  stats.free_bytes += GET_SIZE(blk);
+  stats.free_blocks[size_class(GET_SIZE(blk))]++;
+#if MM_INSTRUMENT
+  ins_nfree++;
+#endif
+  if (GET_SIZE(blk) < FREE_BS) return;
+  index_insert(blk);
+}
 
-  assert(mm_initialized);
+/// @brief remove free block @a blk from the free block index of the allocation policy
+/// @param blk header of free block (the size in the header must still be the one it was
+///            inserted with)
+static void fl_remove(void *blk)
+{
+  stats.free_bytes -= GET_SIZE(blk);
+  stats.free_blocks[size_class(GET_SIZE(blk))]--;
+#if MM_INSTRUMENT
+  ins_nfree--;
+#endif
+  if (GET_SIZE(blk) < FREE_BS) return;
+  index_remove(blk);
+}
 
-  // If prt is null, mm_malloc
-  if (ptr == NULL) {
-    return mm_malloc(size);
+/// @brief add (@a n = 1) or remove (@a n = -1) an allocated block of @a size bytes to or from
+///        the allocated block count of its size class
+/// @param size block size in bytes
+/// @param n 1 or -1
+static void count_alloc(size_t size, int n)
+{
+  stats.alloc_blocks[size_class(size)] += n;
+}
+
+/// @brief set or clear the PREV_ALLOC flag in the header of block @a blk
+/// @param blk block header
+/// @param prev_alloc status of the block preceding @a blk (ALLOC or FREE)
+static void set_prev_alloc(void *blk, int prev_alloc)
+{
+  // the header may belong to an allocated block whose owner accesses it without the heap lock
+  if (prev_alloc == ALLOC) __atomic_fetch_or((TYPE*)blk, PREV_ALLOC, __ATOMIC_RELAXED);
+  else __atomic_fetch_and((TYPE*)blk, ~(TYPE)PREV_ALLOC, __ATOMIC_RELAXED);
+}
+
+/// @brief turn @a blk into a free block of @a size bytes: write header & footer and clear the
+///        PREV_ALLOC flag of the following block. The PREV_ALLOC flag of @a blk is preserved.
+/// @param blk block header
+/// @param size block size in bytes
+static void mark_free(void *blk, size_t size)
+{
+  PUT(blk, PACK(size, FREE | GET_PREV_ALLOC(blk)));
+  PUT(HDR2FTR(blk), PACK(size, FREE));
+  set_prev_alloc(blk + size, FREE);
+}
+
+/// @brief turn @a blk into an allocated block of @a size bytes: write the header (allocated
+///        blocks have no footer) and set the PREV_ALLOC flag of the following block. The
+///        PREV_ALLOC flag of @a blk is preserved.
+/// @param blk block header
+/// @param size block size in bytes
+static void mark_alloc(void *blk, size_t size)
+{
+  PUT(blk, PACK(size, ALLOC | GET_PREV_ALLOC(blk)));
+  set_prev_alloc(blk + size, ALLOC);
+}
+
+/// @brief clear the boundary tags between two adjacent known-zero free blocks that are merged:
+///        the footer of the lower block and the header and link words of the upper block. The
+///        header of the upper block is cleared, so callers must read its size first.
+/// @param blk header of the upper block
+static void clear_tags(void *blk)
+{
+  // a fragment smaller than FREE_BS ends before the link words would
+  memset(PREV_PTR(blk), 0, MIN(FREE_BS, TYPE_SIZE + GET_SIZE(blk)));
+}
+
+/// @brief merge free block @a blk with its free neighbours. Neighbours are removed from their
+///        free lists; @a blk itself must not be in a free list. The coalesced block is known to
+///        be zero if all merged blocks are.
+/// @param blk header of free block
+/// @retval void* header of the coalesced free block (not inserted into a free list)
+static void* coalesce(void *blk)
+{
+  size_t size = GET_SIZE(blk);
+  TYPE zero = GET_ZERO(blk);
+
+  // If the previous block is free, coalesce (only then its footer is valid)
+  if (!GET_PREV_ALLOC(blk)) {
+    void *prev = FTR2HDR(PREV_PTR(blk));
+    fl_remove(prev);
+    if (zero && GET_ZERO(prev)) clear_tags(blk);
+    else zero = 0;
+    size += GET_SIZE(prev);
+    blk = prev;
+    stats.ncoalesce++;
   }
 
-  // If size is zero, mm_free
-  if (size == 0) {
-    mm_free(ptr);
-    return NULL;
+  // If the next block is free, coalesce
+  void *next = blk + size;
+  if (!GET_ALLOC(next)) {
+    size_t next_size = GET_SIZE(next);
+    fl_remove(next);
+    if (zero && GET_ZERO(next)) clear_tags(next);
+    else zero = 0;
+    size += next_size;
+    stats.ncoalesce++;
   }
 
-  // Get original size
-  size_t old_size = GET_SIZE(PREV_PTR(ptr));
+  mark_free(blk, size);
+  PUT(blk, GET(blk) | zero);
 
-  // Caculate new size
-  size_t new_size = ROUND_UP(TYPE_SIZE + size + TYPE_SIZE);
+  return blk;
+}
 
-  // if new size equals to old size, return ptr
-  if (new_size == old_size) {
-    return ptr;
-  }
+/// @brief allocate @a blocksize bytes of free block @a blk. Splits off the remainder if it is
+///        large enough to form a block on its own and returns it to the free lists. The
+///        remainder of a known-zero block is known to be zero, too.
+/// @param blk header of free block (must not be in a free list)
+/// @param blocksize size of block to allocate (including header & footer tags), in bytes
+static void place(void *blk, size_t blocksize)
+{
+  size_t free_block_size = GET_SIZE(blk);
 
-  // If new size is smaller than old size, downsize allocate blocks
-  if (new_size < old_size) {
-    // Free old size - new size
-    PUT(HDR2FTR(PREV_PTR(ptr)), PACK(old_size - new_size, FREE));
-    PUT(FTR2HDR(HDR2FTR(PREV_PTR(ptr))), PACK(old_size - new_size, FREE));
-    // Coalesce if next block is free
-    if (GET_STATUS(NEXT_PTR(HDR2FTR(PREV_PTR(ptr)))) == FREE) {
-      size_t new_free_size = GET_SIZE(HDR2FTR(PREV_PTR(ptr))) + GET_SIZE(NEXT_PTR(HDR2FTR(PREV_PTR(ptr))));
-      // Coalesce two free blocks
-      PUT(HDR2FTR(NEXT_PTR(HDR2FTR(PREV_PTR(ptr)))), PACK(new_free_size, FREE));
-      PUT(FTR2HDR(HDR2FTR(PREV_PTR(ptr))), PACK(new_free_size, FREE));
-    } 
-    // Allocate new size
-    PUT(PREV_PTR(ptr), PACK(new_size, ALLOC));
-    PUT(HDR2FTR(PREV_PTR(ptr)), PACK(new_size, ALLOC));
-    return ptr;
+  // If the remainder is large enough to be listed as a free block
+  if (free_block_size >= blocksize + FREE_BS) {
+    // Split block
+    TYPE zero = GET_ZERO(blk);
+    PUT(blk, PACK(blocksize, ALLOC | GET_PREV_ALLOC(blk)));
+    void *remainder = NEXT_BLK(blk);
+    PUT(remainder, PACK(free_block_size - blocksize, FREE | PREV_ALLOC) | zero);
+    PUT(HDR2FTR(remainder), PACK(free_block_size - blocksize, FREE));
+    set_prev_alloc(NEXT_BLK(remainder), FREE);
+    fl_insert(remainder);
+    stats.nsplit++;
+  } else { // It is better, merge small free block into allocate block
+    mark_alloc(blk, free_block_size);
   }
+  count_alloc(GET_SIZE(blk), 1);
+}
 
-  // Check next block that possibly merging to origin block
-  void *next_block = NEXT_BLK_FROM_PAYLOAD(ptr);
-  size_t next_size = GET_SIZE(next_block);
-  // Check next block that possibly merging to origin block
-  if (GET_STATUS(next_block) == FREE && old_size + next_size >= new_size) {
-    // Merge origin block to next block
-    PUT(HDR2FTR(NEXT_BLK(PREV_PTR(ptr))), PACK(old_size + next_size - new_size, FREE));
-    PUT(FTR2HDR(HDR2FTR(NEXT_BLK(PREV_PTR(ptr)))), PACK(old_size + next_size - new_size, FREE));
-    // Set header and footer
-    PUT(PREV_PTR(ptr), PACK(new_size, ALLOC));
-    PUT(HDR2FTR(PREV_PTR(ptr)), PACK(new_size, ALLOC));
-    return ptr;
+/// @brief grow the heap so that a free block of at least @a blocksize bytes exists at its end
+/// @param blocksize size of block (including header & footer tags), in bytes
+/// @retval void* header of the new free block (not inserted into a free list)
+/// @retval NULL if the data segment cannot be expanded
+static void* extend_heap(size_t blocksize)
+{
+  void *old_heap_end = heap_end;
+
+  // Decide how much to expand the heap by: grow the chunk size if the heap grows in quick
+  // succession, shrink it after a long pause
+  if (trim_age < CHUNK_WINDOW) {
+    chunk_size = MIN(2*chunk_size, MIN(CHUNKMAX, MAX((heap_end - heap_start) >> CHUNK_SHIFT, CHUNKSIZE)));
   }
+  else if (trim_age >= TRIM_DECAY) chunk_size = MAX(chunk_size/2, CHUNKSIZE);
+  size_t expand_size = MAX(chunk_size, blocksize);
 
-  // Allocate new block
-  void *new_ptr = mm_malloc(size);
-  if (new_ptr == NULL) {
-    return NULL;
+  // Expand heap by expand_size; near the end of the data segment, a whole chunk may not fit
+  if ((ds_sbrk(expand_size) == (void*)-1) &&
+      ((expand_size == blocksize) || (ds_sbrk(blocksize) == (void*)-1))) {
+    return NULL; // Expansion failed
   }
+  // Stroe ds heap start pointer and brk pointer
+  ds_heap_stat(&ds_heap_start, &ds_heap_brk, NULL);
+  trim_age = 0;
+  stats.ngrow++;
+  // Update heap_end
+  heap_end = PTR(WORD(ds_heap_brk - TYPE_SIZE) / BS * BS);
 
-  // Copy data from older one
-  size_t copy_size = old_size - TYPE_SIZE;
-  memcpy(new_ptr, ptr, copy_size);
+  // Initialize the newly allocated block at the position of the old end sentinel. The old
+  // sentinel's header holds the PREV_ALLOC flag of the new block. The block is known to be zero
+  // unless the heap has been larger before.
+  size_t expanded_block_size = WORD(heap_end) - WORD(old_heap_end);
+  TYPE zero = (zero_mark <= NEXT_PTR(old_heap_end)) ? ZERO : 0;
+  PUT(old_heap_end, PACK(expanded_block_size, FREE | GET_PREV_ALLOC(old_heap_end)) | zero);
+  PUT(HDR2FTR(old_heap_end), PACK(expanded_block_size, FREE));
+  zero_mark = MAX(zero_mark, NEXT_PTR(heap_end));
 
-  // Free original block
-  mm_free(ptr);
-  // Return new payload pointer
-  return new_ptr;
+  // Update the post heap block (end sentinel)
+  PUT(heap_end, PACK(0, ALLOC));
+
+  // Merge with a trailing free block
+  return coalesce(old_heap_end);
 }
 
-void mm_free(void *ptr)
+/// @brief free the allocated block @a blk: coalesce it with its neighbours and return it to the
+///        free lists. In madvise mode, the pages of a large coalesced block are discarded.
+/// @param blk header of allocated block
+static void release_block(void *blk)
 {
-  LOG(1, "mm_free(%p)", ptr);
+  size_t size = GET_SIZE(blk);
+  void *lo = blk, *hi = blk + size;
 
-  assert(mm_initialized);
-  // Get head pointer
-  void* head_ptr = PREV_PTR(ptr);
-
-  // If ptr is null, return
-  if (ptr == NULL) {
-    return;
+  // Mark the block as free
+  count_alloc(size, -1);
+  mark_free(blk, size);
+
+  // Free neighbours that reached SHRINKTHLD were discarded when they were released; only the
+  // pages of smaller ones have to be discarded along with this block
+  if (use_madvise) {
+    if (!GET_PREV_ALLOC(blk) && (GET_SIZE(PREV_PTR(blk)) < SHRINKTHLD)) lo = FTR2HDR(PREV_PTR(blk));
+    if (!GET_ALLOC(hi) && (GET_SIZE(hi) < SHRINKTHLD)) hi += GET_SIZE(hi);
   }
 
-  // If already free, return
-  if (GET_STATUS(head_ptr) == FREE) {
-    return;
+  // Coalesce with free neighbours
+  blk = coalesce(blk);
+  size = GET_SIZE(blk);
+  fl_insert(blk);
+
+  // Keep the head of the block (most likely to be reused by place()) and the boundary tags
+  if (use_madvise && (size >= SHRINKTHLD)) {
+    lo = MAX(lo, blk + MAX(TRIM_PAD, FREE_BS));
+    hi = MIN(hi, HDR2FTR(blk));
+    if (hi > lo) ds_discard(lo, hi - lo);
   }
+}
 
-  // Retrieve the size of the block to be freed
-  size_t size = (size_t) GET_SIZE(head_ptr);
+/// @brief shrink the heap if the free block at its end has reached the high watermark, or if it
+///        exceeds the low watermark and the heap has not grown for TRIM_DECAY operations. The
+///        trim leaves a free block of about TRIM_PAD bytes at the end of the heap.
+static void trim_heap(void)
+{
+  // The block before the end sentinel must be free
+  if (use_madvise || GET_PREV_ALLOC(heap_end)) return;
 
-  // Mark the block as free
-  PUT(head_ptr, PACK(size, FREE));
-  PUT(HDR2FTR(head_ptr), PACK(size, FREE));
+  // The rest of the last chunk does not count towards the high watermark
+  void *blk = FTR2HDR(PREV_PTR(heap_end));
+  size_t size = GET_SIZE(blk);
+  if ((size < SHRINKTHLD + chunk_size) && ((size <= TRIM_PAD) || (trim_age < TRIM_DECAY))) return;
 
-  // If the previous block is free, coalesce
-  if (GET_STATUS(PREV_PTR(head_ptr)) == FREE) {
-    size += GET_SIZE(PREV_PTR(head_ptr));
-    PUT(FTR2HDR(PREV_PTR(head_ptr)), PACK(size, FREE));
-    PUT(HDR2FTR(head_ptr), PACK(size, FREE));
-    // Set new header pointer
-    head_ptr = FTR2HDR(PREV_PTR(head_ptr));
-  }
+  // Cut everything above TRIM_PAD; a remainder too small for a free list goes, too
+  size_t keep = MIN(size, TRIM_PAD) / BS * BS;
+  if (keep < FREE_BS) keep = 0;
+  size_t cut = size - keep;
 
-  // If the next block is free, coalesce
-  if (GET_STATUS(NEXT_BLK(head_ptr)) == FREE) {
-    size += GET_SIZE(NEXT_BLK(head_ptr));
-    PUT(head_ptr, PACK(size, FREE));
-    PUT(HDR2FTR(head_ptr), PACK(size, FREE));
-  }
-
-  // Check if this is the last block in the heap and size > CHUNKSIZE
-  if (NEXT_BLK(head_ptr) == heap_end && size >= SHRINKTHLD) {
-    // Perform heap shrink
-    ds_sbrk(-size);
-    ds_heap_stat(&ds_heap_start, &ds_heap_brk, NULL);
-    PAGESIZE = ds_getpagesize();
-    // Update heap_end if you maintain it
-    heap_end -= size;
-    // Update end sentinel half-block
+  fl_remove(blk);
+  ds_sbrk(-cut);
+  ds_heap_stat(&ds_heap_start, &ds_heap_brk, NULL);
+  heap_end -= cut;
+  trim_age = 0;
+  stats.nshrink++;
+  chunk_size = MAX(chunk_size/2, CHUNKSIZE);
+
+  if (keep == 0) {
+    // Update end sentinel half-block. A coalesced block is always preceded by an allocated one.
+    PUT(heap_end, PACK(0, ALLOC | PREV_ALLOC));
+  } else {
+    PUT(blk, PACK(keep, FREE | GET_PREV_ALLOC(blk)) | GET_ZERO(blk));
+    PUT(HDR2FTR(blk), PACK(keep, FREE));
     PUT(heap_end, PACK(0, ALLOC));
+    fl_insert(blk);
   }
 }
 
-/// @name block allocation policites
-/// @{
+static void *quick_list[QL_BINS];                      ///< quick lists of freed small blocks, one per block size
+static size_t quick_bytes = 0;                         ///< total size of the blocks in the quick lists
 
-/// @brief find and return a free block of at least @a size bytes (first fit)
-/// @param size size of block (including header & footer tags), in bytes
-/// @retval void* pointer to header of large enough free block
-/// @retval NULL if no free block of the requested size is avilable
-static void* ff_get_free_block(size_t size)
+/// @brief put allocated block @a blk into the quick list of its size if deferred coalescing is
+///        active and the block is small enough. Quick-listed blocks stay allocated (with the
+///        QUICK flag set) and are linked through their first payload word.
+/// @param blk header of allocated block
+/// @retval 1 if @a blk has been quick-listed
+/// @retval 0 otherwise
+static int ql_push(void *blk)
 {
-  LOG(1, "ff_get_free_block(1x%lx (%lu))", size, size);
+  size_t size = GET_SIZE(blk);
+  if (!defer_coalesce || (size > QL_MAXBLOCK)) return 0;
+
+  // the QUICK flag replaces any slack bits
+  PUT(blk, PACK(size, ALLOC | QUICK | GET_PREV_ALLOC(blk)));
+  NEXT_FREE(blk) = quick_list[size / 16];
+  quick_list[size / 16] = blk;
+  quick_bytes += size;
+
+  return 1;
+}
+
+/// @brief take a block of @a blocksize bytes from its quick list
+/// @param blocksize size of block (including header), in bytes
+/// @retval void* header of allocated block
+/// @retval NULL if no such block is quick-listed
+static void* ql_pop(size_t blocksize)
+{
+  if (!defer_coalesce || (blocksize > QL_MAXBLOCK)) return NULL;
+
+  void *blk = quick_list[blocksize / 16];
+  if (blk != NULL) {
+    quick_list[blocksize / 16] = NEXT_FREE(blk);
+    quick_bytes -= blocksize;
+    PUT(blk, GET(blk) & ~(TYPE)QUICK);
+  }
+  return blk;
+}
+
+/// @brief batch coalescing: release all quick-listed blocks to the free block index, merging
+///        them with their free neighbours
+/// @retval int 1 if any block has been released, 0 if the quick lists were empty
+static int ql_sweep(void)
+{
+  if (quick_bytes == 0) return 0;
+
+  for (int i = 0; i < QL_BINS; i++) {
+    while (quick_list[i] != NULL) {
+      void *blk = quick_list[i];
+      quick_list[i] = NEXT_FREE(blk);
+      release_block(blk);
+    }
+  }
+  quick_bytes = 0;
+
+  return 1;
+}
+
+/// @brief check whether free block @a blk can hold @a size bytes starting at an address aligned
+///        to @a align. The block starts at the last BS boundary before the aligned address if
+///        that leaves a leading part large enough to be listed as free block on its own.
+/// @param blk header of free block
+/// @param size number of bytes required at the aligned address
+/// @param align alignment (power of 2)
+/// @param[out] hdr header of the block to allocate (@a blk or a later address inside @a blk)
+/// @param[out] aligned aligned address
+/// @param[out] blocksize size of the block to allocate at @a hdr
+/// @retval 1 if the request fits into @a blk
+/// @retval 0 otherwise
+static int aligned_fit(void *blk, size_t size, size_t align,
+                       void **hdr, void **aligned, size_t *blocksize)
+{
+  void *a = PTR(ALIGN_UP(WORD(blk) + TYPE_SIZE, align));
+  void *h = PTR(ALIGN_DOWN(WORD(a) - TYPE_SIZE, BS));
+  if (h - blk < FREE_BS) h = blk;
+
+  *hdr = h;
+  *aligned = a;
+  *blocksize = ROUND_UP(a + size - h);
+
+  return h + *blocksize <= blk + GET_SIZE(blk);
+}
+
+/// @brief find a free block in the free block index that can hold @a size bytes starting at an
+///        address aligned to @a align (see aligned_fit() for the output parameters)
+/// @retval void* header of free block
+/// @retval NULL if no free block fits
+static void* aligned_search(size_t size, size_t align, void **hdr, void **aligned, size_t *blocksize)
+{
+  size_t minsize = ROUND_UP(TYPE_SIZE + size);
+  void *free_block = NULL;
+
+  // In the trees, the block found for minsize bytes may be misaligned; a block of minsize +
+  // align + FREE_BS bytes always fits.
+  if (index_insert != sl_insert) {
+    void *(*search)(size_t) = (index_insert == bt_insert) ? bt_search : at_search;
+    void *p = search(minsize);
+    if ((p != NULL) && !aligned_fit(p, size, align, hdr, aligned, blocksize)) {
+      p = search(minsize + align + FREE_BS);
+      if ((p != NULL) && !aligned_fit(p, size, align, hdr, aligned, blocksize)) p = NULL;
+    }
+    free_block = p;
+  }
+  for (int c = size_class(minsize); (c < NUM_CLASSES) && (free_block == NULL); c++) {
+    for (void *p = free_list[c]; p != NULL; p = NEXT_FREE(p)) {
+      if (aligned_fit(p, size, align, hdr, aligned, blocksize)) {
+        free_block = p;
+        break;
+      }
+    }
+  }
+
+  return free_block;
+}
+
+/// @brief allocate a block that holds @a size bytes starting at an address aligned to @a align.
+///        The misaligned leading part of the chosen free block is split off as a free block.
+/// @param size number of bytes required at the aligned address
+/// @param align alignment (power of 2)
+/// @param[out] blk header of the allocated block
+/// @retval void* aligned address inside the payload of @a blk
+/// @retval NULL if memory allocation failed
+static void* alloc_aligned(size_t size, size_t align, void **blk)
+{
+  size_t minsize = ROUND_UP(TYPE_SIZE + size);
+  void *h, *a;
+  size_t blocksize;
+
+  // Find a free block in the index that can hold the aligned request. Merge the quick-listed
+  // blocks if there is none.
+  void *free_block = aligned_search(size, align, &h, &a, &blocksize);
+  if ((free_block == NULL) && ql_sweep()) {
+    free_block = aligned_search(size, align, &h, &a, &blocksize);
+  }
+
+  if (free_block != NULL) {
+    fl_remove(free_block);
+  } else {
+    // When there's no such block, expand heap by enough to cover any misalignment
+    free_block = extend_heap(minsize + align + FREE_BS);
+    if (free_block == NULL) {
+      return NULL; // Expansion failed
+    }
+    if (!aligned_fit(free_block, size, align, &h, &a, &blocksize)) {
+      fl_insert(free_block);
+      return NULL;
+    }
+  }
+
+  // Split off the leading part. Both parts keep the known-zero flag.
+  if (h != free_block) {
+    TYPE zero = GET_ZERO(free_block);
+    PUT(h, PACK(GET_SIZE(free_block) - (h - free_block), FREE) | zero);
+    mark_free(free_block, h - free_block);
+    PUT(free_block, GET(free_block) | zero);
+    fl_insert(free_block);
+    stats.nsplit++;
+  }
+
+  // Allocate (and split) the rest
+  place(h, blocksize);
+
+  *blk = h;
+  return a;
+}
+
+/// @brief header of the block holding payload @a ptr. Aligned payloads that do not directly
+///        follow the header are preceded by a pseudo header with the offset to the block header.
+/// @param ptr pointer to payload (not a slab slot)
+/// @retval void* block header
+static inline void* payload_hdr(void *ptr)
+{
+  TYPE hdr = GET(PREV_PTR(ptr));
+
+  return ((hdr & (ALLOC | ALIGNED)) == ALIGNED) ? ptr - (hdr & ~STATUS_MASK) : PREV_PTR(ptr);
+}
+
+/// @}
+
+
+/// @name Slab allocator
+/// @{
+
+/// @brief slab header. Located at the start of the SLAB_SIZE-aligned region of the slab.
+typedef struct __slab {
+  struct __slab *next, *prev;                  ///< prev/next pointers in list of partial slabs
+  void          *blk;                          ///< header of heap block holding the slab
+  size_t        slot_size;                     ///< size of one slot in bytes
+  size_t        nslots;                        ///< number of slots
+  size_t        nfree;                         ///< number of free slots
+  uint64_t      bitmap[SLAB_SIZE/16/64];       ///< free slot bitmap (bit set: slot free)
+} Slab;
+
+#define SLAB_SLOTS(s)      ((void*)(s) + ALIGN_UP(sizeof(Slab), 16))            ///< first slot of slab s
+#define SLAB_OF(p)         ((Slab*)ALIGN_DOWN(WORD(p), SLAB_SIZE))             ///< slab containing slot p
+
+static Slab *slab_partial[SLAB_CLASSES];               ///< slabs with at least one free slot, per class
+static unsigned char *slab_map = NULL;                 ///< one bit per SLAB_SIZE unit of the data segment
+static void *slab_base     = NULL;                     ///< address of the first unit in slab_map
+static size_t slab_units   = 0;                        ///< number of units in slab_map
+
+/// @brief check whether @a ptr points into a slab
+/// @param ptr pointer to check
+/// @retval 1 if @a ptr lies in a slab
+/// @retval 0 otherwise
+static int is_slab(void *ptr)
+{
+  size_t unit = (WORD(ptr) - WORD(slab_base)) / SLAB_SIZE;
+
+  // Called without the heap lock by the thread caches; neighbouring bits may change meanwhile
+  return (ptr >= slab_base) && (unit < slab_units) &&
+         (__atomic_load_n(&slab_map[unit / 8], __ATOMIC_RELAXED) & (1 << (unit % 8)));
+}
+
+/// @brief mark/unmark the unit holding slab @a s in the slab map
+/// @param s slab
+/// @param active 1: mark as slab, 0: unmark
+static void slab_setmap(Slab *s, int active)
+{
+  size_t unit = (WORD(s) - WORD(slab_base)) / SLAB_SIZE;
+
+  if (active) __atomic_fetch_or(&slab_map[unit / 8], 1 << (unit % 8), __ATOMIC_RELAXED);
+  else __atomic_fetch_and(&slab_map[unit / 8], ~(1 << (unit % 8)), __ATOMIC_RELAXED);
+}
+
+/// @brief insert slab @a s at the head of the partial list of class @a c
+static void slab_push(Slab *s, int c)
+{
+  s->prev = NULL;
+  s->next = slab_partial[c];
+  if (s->next != NULL) s->next->prev = s;
+  slab_partial[c] = s;
+}
+
+/// @brief unlink slab @a s from the partial list of class @a c
+static void slab_unlink(Slab *s, int c)
+{
+  if (s->prev != NULL) s->prev->next = s->next;
+  else slab_partial[c] = s->next;
+  if (s->next != NULL) s->next->prev = s->prev;
+}
+
+/// @brief reset the slab allocator. Allocates a fresh slab map if slabs are active.
+static void slab_init(void)
+{
+  free(slab_map);
+  slab_map = NULL;
+  slab_base = NULL;
+  slab_units = 0;
+  memset(slab_partial, 0, sizeof(slab_partial));
+
+  if (!use_slab) return;
+
+  void *start, *end;
+  ds_heap_stat(&start, NULL, &end);
+  slab_base = PTR(ALIGN_DOWN(WORD(start), SLAB_SIZE));
+  slab_units = (end - slab_base) / SLAB_SIZE + 1;
+  slab_map = calloc((slab_units + 7) / 8, 1);
+  if (slab_map == NULL) PANIC("Cannot allocate slab map.");
+}
+
+/// @brief allocate a slot of at least @a size bytes
+/// @param size requested size in bytes (1 <= size <= SLAB_MAX)
+/// @retval void* pointer to slot
+/// @retval NULL if no slab could be allocated
+static void* slab_alloc(size_t size)
+{
+  int c = (size - 1) / 16;
+  Slab *s = slab_partial[c];
+
+  // If there is no partial slab, carve a new one out of the heap
+  if (s == NULL) {
+    void *blk;
+    s = alloc_aligned(SLAB_SIZE, SLAB_SIZE, &blk);
+    if (s == NULL) return NULL;
+
+    s->blk = blk;
+    s->slot_size = 16 * (c + 1);
+    s->nslots = (SLAB_SIZE - (SLAB_SLOTS(s) - (void*)s)) / s->slot_size;
+    s->nfree = s->nslots;
+    memset(s->bitmap, 0, sizeof(s->bitmap));
+    for (size_t i = 0; i < s->nslots; i++) s->bitmap[i / 64] |= 1UL << (i % 64);
+
+    slab_setmap(s, 1);
+    slab_push(s, c);
+  }
+
+  // Take the first free slot
+  size_t w = 0;
+  while (s->bitmap[w] == 0) w++;
+  size_t idx = w * 64 + __builtin_ctzl(s->bitmap[w]);
+  s->bitmap[w] &= ~(1UL << (idx % 64));
+
+  if (--s->nfree == 0) slab_unlink(s, c);
+
+  return SLAB_SLOTS(s) + idx * s->slot_size;
+}
+
+/// @brief free slot @a ptr. Returns the slab to the heap once all of its slots are free.
+/// @param ptr pointer to slot
+static void slab_free(void *ptr)
+{
+  Slab *s = SLAB_OF(ptr);
+  int c = s->slot_size / 16 - 1;
+  size_t ofs = ptr - SLAB_SLOTS(s);
+  size_t idx = ofs / s->slot_size;
+
+  // If not a slot or already free, return
+  if ((ptr < SLAB_SLOTS(s)) || (ofs % s->slot_size != 0) || (idx >= s->nslots)) return;
+  if (s->bitmap[idx / 64] & (1UL << (idx % 64))) return;
+
+  s->bitmap[idx / 64] |= 1UL << (idx % 64);
+  s->nfree++;
+
+  if (s->nfree == s->nslots) {
+    // Slab is empty, give it back to the heap
+    if (s->nslots > 1) slab_unlink(s, c);
+    slab_setmap(s, 0);
+    release_block(s->blk);
+  } else if (s->nfree == 1) {
+    // Slab was full, make it available again
+    slab_push(s, c);
+  }
+}
+
+/// @}
+
+
+/// @name Heap operations
+/// Implementation of malloc/realloc/free on the heap. In thread-safe mode, callers hold the heap lock.
+/// @{
+
+/// @brief log2 histogram bin of @a n (see MMStats)
+/// @param n count
+/// @retval int bin (0 for 0, i for [2^(i-1), 2^i))
+static inline int search_bin(unsigned long n)
+{
+  int bin = n ? 64 - __builtin_clzl(n) : 0;
+  return MIN(bin, MM_SEARCH_BINS-1);
+}
+
+#if MM_INSTRUMENT
+/// @brief write the search length histograms to the file named by MM_INSTRUMENT_OUT (JSON if the
+///        name ends in .json, CSV otherwise) or as CSV to stderr. Registered with atexit().
+static void ins_dump(void)
+{
+  static const char *name[] = { "first fit", "next fit", "best fit" };
+  const char *fn = getenv("MM_INSTRUMENT_OUT");
+  FILE *f = stderr;
+
+  if ((fn != NULL) && ((f = fopen(fn, "w")) == NULL)) {
+    fprintf(stderr, "mm_instrument: cannot open '%s'\n", fn);
+    return;
+  }
+  int json = (fn != NULL) && (strlen(fn) >= 5) && (strcmp(fn + strlen(fn) - 5, ".json") == 0);
+
+  // bin i covers [2^(i-1), 2^i); the last bin is open (max -1 in CSV, null in JSON)
+  #define BIN_MIN(b) ((b) ? 1L << ((b)-1) : 0L)
+  #define BIN_MAX(b) ((b) == MM_SEARCH_BINS-1 ? -1L : (1L << (b)) - 1)
+
+  if (json) fprintf(f, "[");
+  else fprintf(f, "policy,searches,visits,max_visits,free_blocks_min,free_blocks_max,visits_min,visits_max,count\n");
+
+  int first = 1;
+  for (int p = 0; p < 3; p++) {
+    if (ins_nsearch[p] == 0) continue;
+
+    if (json) {
+      fprintf(f, "%s\n  {\"policy\": \"%s\", \"searches\": %lu, \"visits\": %lu, \"max_visits\": %lu, \"histogram\": [",
+              first ? "" : ",", name[p], ins_nsearch[p], ins_visits[p], ins_maxvisits[p]);
+    }
+    int firstbin = 1;
+    for (int n = 0; n < MM_SEARCH_BINS; n++) {
+      for (int v = 0; v < MM_SEARCH_BINS; v++) {
+        unsigned long c = ins_hist[p][n][v];
+        if (c == 0) continue;
+        if (json) {
+          fprintf(f, "%s\n    {\"free_blocks\": [%ld, ", firstbin ? "" : ",", BIN_MIN(n));
+          if (BIN_MAX(n) < 0) fprintf(f, "null"); else fprintf(f, "%ld", BIN_MAX(n));
+          fprintf(f, "], \"visits\": [%ld, ", BIN_MIN(v));
+          if (BIN_MAX(v) < 0) fprintf(f, "null"); else fprintf(f, "%ld", BIN_MAX(v));
+          fprintf(f, "], \"count\": %lu}", c);
+        } else {
+          fprintf(f, "%s,%lu,%lu,%lu,%ld,%ld,%ld,%ld,%lu\n", name[p], ins_nsearch[p], ins_visits[p],
+                  ins_maxvisits[p], BIN_MIN(n), BIN_MAX(n), BIN_MIN(v), BIN_MAX(v), c);
+        }
+        firstbin = 0;
+      }
+    }
+    if (json) fprintf(f, "\n  ]}");
+    first = 0;
+  }
+  if (json) fprintf(f, "\n]\n");
+
+  #undef BIN_MIN
+  #undef BIN_MAX
+
+  if (f != stderr) fclose(f);
+}
+#endif
+
+/// @brief find a free block of at least @a blocksize bytes with the allocation policy and record
+///        the number of blocks visited in the search length histogram
+/// @param blocksize size of block (including header & footer tags), in bytes
+/// @retval void* header of free block
+/// @retval NULL if no free block is large enough
+static void* search_free_block(size_t blocksize)
+{
+  search_visits = 0;
+  void *blk = get_free_block(blocksize);
+  int bin = search_bin(search_visits);
+  stats.search[policy][bin]++;
+
+#if MM_INSTRUMENT
+  ins_hist[policy][search_bin(ins_nfree)][bin]++;
+  ins_nsearch[policy]++;
+  ins_visits[policy] += search_visits;
+  ins_maxvisits[policy] = MAX(ins_maxvisits[policy], search_visits);
+#endif
+
+  return blk;
+}
+
+/// @brief allocate a slot or block for @a size bytes
+/// @param size requested size in bytes (> 0)
+/// @param[out] zero if not NULL, set to 1 if the payload is known to be zero, 0 otherwise
+/// @retval void* pointer to payload
+/// @retval NULL if memory allocation failed
+static void* heap_malloc(size_t size, int *zero)
+{
+  if (zero != NULL) *zero = 0;
+
+  // Serve small requests from a slab if possible
+  if (use_slab && (size <= SLAB_MAX)) {
+    void *slot = slab_alloc(size);
+    if (slot != NULL) return slot;
+  }
+  // Round up size as blocksize (header only, allocated blocks have no footer)
+  size_t blocksize = ROUND_UP(TYPE_SIZE + size);
+  trim_age++;
+  // Reuse a quick-listed block of the same size
+  void *quick_block = ql_pop(blocksize);
+  if (quick_block != NULL) return quick_block + TYPE_SIZE;
+  // Get free block pointer; merge the quick-listed blocks before giving up
+  void* free_block = search_free_block(blocksize);
+  if ((free_block == NULL) && ql_sweep()) free_block = search_free_block(blocksize);
+
+  // When there's no free block, expand heap
+  if (free_block == NULL) {
+    free_block = extend_heap(blocksize);
+    if (free_block == NULL) {
+      return NULL; // Expansion failed
+    }
+  } else {
+    fl_remove(free_block);
+  }
+
+  // Allocate (and split) free block. Of a known-zero block, only the link words and the footer
+  // (if the block is not split) have to be cleared.
+  if ((zero != NULL) && GET_ZERO(free_block)) {
+    PUT(NEXT_PTR(free_block), 0);
+    PUT(NEXT_PTR(NEXT_PTR(free_block)), 0);
+    PUT(HDR2FTR(free_block), 0);
+    *zero = 1;
+    stats.nzero++;
+  }
+  place(free_block, blocksize);
+
+  // Return payload pointer
+  return (free_block + TYPE_SIZE);
+}
+
+/// @brief free slot or block @a ptr
+/// @param ptr pointer to payload (not NULL)
+static void heap_free(void *ptr)
+{
+  // Slots go back to their slab
+  if (use_slab && is_slab(ptr)) {
+    slab_free(ptr);
+    trim_heap();
+    return;
+  }
+
+  // Get head pointer
+  void* head_ptr = payload_hdr(ptr);
+
+  // If already free, return
+  if (!GET_ALLOC(head_ptr) || (GET(head_ptr) & QUICK)) {
+    return;
+  }
+
+  // Defer coalescing of small blocks; merge all of them once the quick lists grow too large
+  trim_age++;
+  if (ql_push(head_ptr)) {
+    if (quick_bytes > QL_LIMIT) ql_sweep();
+  } else {
+    release_block(head_ptr);
+  }
+
+  trim_heap();
+}
+
+/// @brief slack to add to a block of @a blocksize bytes that is grown for the @a growth+1-th time
+/// @param blocksize requested block size in bytes
+/// @param growth number of times the block has been grown so far
+/// @retval size_t slack in bytes (multiple of BS)
+static size_t slack_for(size_t blocksize, size_t growth)
+{
+  int shift = (growth < 3) ? 3 - growth : 0;
+
+  return MIN(ROUND_UP(blocksize >> shift), SLACK_MAX * BS);
+}
+
+/// @brief record slack & growth count in the header of allocated block @a blk after it has been
+///        grown to hold @a blocksize bytes
+/// @param blk header of allocated block
+/// @param blocksize size of the block required by the request in bytes
+/// @param growth growth count before this growth step
+static void set_slack(void *blk, size_t blocksize, size_t growth)
+{
+  TYPE slack = MIN((GET_SIZE(blk) - blocksize) / BS, SLACK_MAX);
+  TYPE hdr = GET(blk) & (SIZE_MASK | STATUS_MASK);
+
+  PUT(blk, hdr | (slack << SLACK_SHIFT) | (MIN(growth + 1, GROWTH_MAX) << GROWTH_SHIFT));
+}
+
+/// @brief resize slot or block @a ptr to @a size bytes
+/// @param ptr pointer to payload (not NULL)
+/// @param size new size in bytes (> 0)
+/// @retval void* pointer to (possibly moved) payload
+/// @retval NULL if memory allocation failed; @a ptr is left untouched
+static void* heap_realloc(void *ptr, size_t size)
+{
+  // Slots keep their size; move the data if it does not fit anymore
+  if (use_slab && is_slab(ptr)) {
+    size_t slot_size = SLAB_OF(ptr)->slot_size;
+    if (size <= slot_size) {
+      return ptr;
+    }
+    void *new_ptr = heap_malloc(size, NULL);
+    if (new_ptr == NULL) {
+      return NULL;
+    }
+    memcpy(new_ptr, ptr, slot_size);
+    slab_free(ptr);
+    return new_ptr;
+  }
+
+  // Get original size. An aligned payload starts offset bytes into its block.
+  void *blk = payload_hdr(ptr);
+  size_t offset = ptr - blk;
+  size_t old_size = GET_SIZE(blk);
+  size_t growth = GET_GROWTH(blk);
+
+  // Caculate new size
+  size_t new_size = ROUND_UP(offset + size);
+
+  // A growing block keeps its slack as long as the unused part stays within the slack budget
+  if (realloc_slack && (growth > 0) && (new_size <= old_size) &&
+      (old_size - new_size <= slack_for(new_size, growth))) {
+    set_slack(blk, new_size, growth - 1);
+    return ptr;
+  }
+
+  // if new size equals to old size, return ptr
+  if (new_size == old_size) {
+    return ptr;
+  }
+
+  // If new size is smaller than old size, downsize allocate blocks. A remainder that is too
+  // small to be listed is only given back if it can be merged with a free next block.
+  if (new_size < old_size) {
+    PUT(blk, GET(blk) & (SIZE_MASK | STATUS_MASK));
+    if ((old_size - new_size < FREE_BS) && GET_ALLOC(NEXT_BLK(blk))) {
+      return ptr;
+    }
+    PUT(blk, PACK(new_size, ALLOC | GET_PREV_ALLOC(blk)));
+    count_alloc(old_size, -1);
+    count_alloc(new_size, 1);
+    // Free old size - new size and coalesce it with the next block if that one is free
+    void *remainder = NEXT_BLK(blk);
+    PUT(remainder, PACK(old_size - new_size, PREV_ALLOC));
+    mark_free(remainder, old_size - new_size);
+    fl_insert(coalesce(remainder));
+    stats.nsplit++;
+    return ptr;
+  }
+
+  // Size to grow to, including slack. The in-place strategies take as much of it as available.
+  size_t want_size = realloc_slack ? new_size + slack_for(new_size, growth) : new_size;
+
+  // Check next block that possibly merging to origin block
+  void *next_blk = NEXT_BLK(blk);
+  size_t next_size = GET_ALLOC(next_blk) ? 0 : GET_SIZE(next_blk);
+  if (old_size + next_size >= new_size) {
+    // Merge origin block with next block, then give back what is not needed
+    fl_remove(next_blk);
+    count_alloc(old_size, -1);
+    PUT(blk, PACK(old_size + next_size, FREE | GET_PREV_ALLOC(blk)));
+    place(blk, MIN(want_size, old_size + next_size));
+    if (realloc_slack) set_slack(blk, new_size, growth);
+    return ptr;
+  }
+
+  // If the block is the last one before heap_end (possibly followed by a free block), extend
+  // the heap behind it. extend_heap() merges a trailing free block into the new space. Near the
+  // end of the data segment, the slack is dropped; if the heap cannot grow at all, the block
+  // moves (below).
+  if (next_blk + next_size == heap_end) {
+    void *ext = extend_heap(want_size - old_size - next_size);
+    if ((ext == NULL) && (want_size > new_size)) ext = extend_heap(new_size - old_size - next_size);
+    if (ext != NULL) {
+      count_alloc(old_size, -1);
+      PUT(blk, PACK(old_size + GET_SIZE(ext), FREE | GET_PREV_ALLOC(blk)));
+      place(blk, MIN(want_size, old_size + GET_SIZE(ext)));
+      if (realloc_slack) set_slack(blk, new_size, growth);
+      return ptr;
+    }
+  }
+
+  // Only the used part of the payload needs to be preserved
+  size_t copy_size = old_size - GET_SLACK(blk) * BS - offset;
+
+  // From here on, the payload moves to the start of a regular block
+  if (offset != TYPE_SIZE) {
+    new_size = ROUND_UP(TYPE_SIZE + size);
+    want_size = new_size;
+  }
+
+  // Check previous block (and next block) that possibly merging to origin block. The payload
+  // moves to the start of the previous block.
+  if (!GET_PREV_ALLOC(blk)) {
+    void *prev_blk = FTR2HDR(PREV_PTR(blk));
+    size_t prev_size = GET_SIZE(prev_blk);
+    size_t total_size = prev_size + old_size + next_size;
+    if (total_size >= new_size) {
+      fl_remove(prev_blk);
+      if (next_size > 0) fl_remove(next_blk);
+      count_alloc(old_size, -1);
+      PUT(prev_blk, PACK(total_size, FREE | GET_PREV_ALLOC(prev_blk)));
+      memmove(NEXT_PTR(prev_blk), ptr, copy_size);
+      place(prev_blk, MIN(want_size, total_size));
+      if (realloc_slack) set_slack(prev_blk, new_size, growth);
+      return NEXT_PTR(prev_blk);
+    }
+  }
+
+  // Allocate new block, without slack if there is no room for it
+  void *new_ptr = heap_malloc(want_size - TYPE_SIZE, NULL);
+  if ((new_ptr == NULL) && (want_size > new_size)) new_ptr = heap_malloc(new_size - TYPE_SIZE, NULL);
+  if (new_ptr == NULL) {
+    return NULL;
+  }
+  if (realloc_slack && !(use_slab && is_slab(new_ptr))) {
+    set_slack(PREV_PTR(new_ptr), new_size, growth);
+  }
+
+  // Copy data from older one
+  memcpy(new_ptr, ptr, copy_size);
+
+  // Free original block
+  heap_free(ptr);
+  // Return new payload pointer
+  return new_ptr;
+}
+
+/// @brief allocate a slot or block for @a size bytes at an address aligned to @a align
+/// @param align alignment (power of 2)
+/// @param size requested size in bytes (> 0)
+/// @retval void* pointer to aligned payload
+/// @retval NULL if memory allocation failed
+static void* heap_memalign(size_t align, size_t size)
+{
+  // Every payload is TYPE_SIZE-aligned, every slot 16-byte aligned
+  if ((align <= TYPE_SIZE) || ((align <= 16) && use_slab && (size <= SLAB_MAX))) {
+    return heap_malloc(size, NULL);
+  }
+
+  trim_age++;
+  void *blk;
+  void *ptr = alloc_aligned(size, align, &blk);
+  if (ptr == NULL) {
+    return NULL;
+  }
+
+  // Link the payload to its header if it does not directly follow it
+  if (ptr != NEXT_PTR(blk)) PUT(PREV_PTR(ptr), (ptr - blk) | ALIGNED);
+
+  return ptr;
+}
+
+/// @brief allocate @a count blocks for @a size bytes each, carved out of one free run that is
+///        found with a single search. Falls back to single allocations if no run can be found
+///        or created.
+/// @param size requested size per block in bytes (> 0)
+/// @param count number of blocks
+/// @param[out] ptrs payloads of the allocated blocks
+/// @retval size_t number of blocks allocated
+static size_t heap_malloc_bulk(size_t size, size_t count, void **ptrs)
+{
+  size_t blocksize = ROUND_UP(TYPE_SIZE + size);
+  size_t n = 0;
+
+  // Small requests are served from slabs
+  if (!(use_slab && (size <= SLAB_MAX)) && (count <= (SIZE_MAX - BS) / blocksize)) {
+    size_t runsize = count * blocksize;
+    trim_age += count;
+    void *run = search_free_block(runsize);
+    if ((run == NULL) && ql_sweep()) run = search_free_block(runsize);
+    if (run == NULL) run = extend_heap(runsize);
+    else fl_remove(run);
+
+    if (run != NULL) {
+      // Carve the blocks from the start of the run; the last one splits off the rest
+      size_t run_size = GET_SIZE(run);
+      TYPE zero = GET_ZERO(run);
+      TYPE prev_alloc = GET_PREV_ALLOC(run);
+      void *blk = run;
+      for (n = 0; n < count - 1; n++) {
+        PUT(blk, PACK(blocksize, ALLOC | prev_alloc));
+        count_alloc(blocksize, 1);
+        ptrs[n] = NEXT_PTR(blk);
+        prev_alloc = PREV_ALLOC;
+        blk += blocksize;
+      }
+      PUT(blk, PACK(run_size - (blk - run), FREE | prev_alloc) | zero);
+      place(blk, blocksize);
+      ptrs[n++] = NEXT_PTR(blk);
+      stats.nsplit += count - 1;
+      return n;
+    }
+  }
+
+  for (; n < count; n++) {
+    if ((ptrs[n] = heap_malloc(size, NULL)) == NULL) break;
+  }
+  return n;
+}
+
+/// @brief order pointers by address (for qsort)
+static int ptr_cmp(const void *a, const void *b)
+{
+  void *x = *(void* const*)a, *y = *(void* const*)b;
+  return (x > y) - (x < y);
+}
+
+/// @brief free the slots and blocks in @a ptrs. The array is sorted by address, so that runs of
+///        adjacent blocks are released (and coalesced with their neighbours) as one block.
+/// @param ptrs pointers to payloads (NULL entries are skipped)
+/// @param count number of pointers
+static void heap_free_bulk(void **ptrs, size_t count)
+{
+  qsort(ptrs, count, sizeof(void*), ptr_cmp);
+
+  void *run = NULL, *run_end = NULL;
+  for (size_t i = 0; i < count; i++) {
+    void *ptr = ptrs[i];
+    if (ptr == NULL) continue;
+
+    // Slots go back to their slab
+    if (use_slab && is_slab(ptr)) {
+      slab_free(ptr);
+      continue;
+    }
+
+    // Skip free blocks and duplicates
+    void *blk = payload_hdr(ptr);
+    if (!GET_ALLOC(blk) || (GET(blk) & QUICK) || (blk < run_end)) continue;
+    trim_age++;
+
+    // Extend the current run by an adjacent block, or release it and start a new one. The run
+    // is counted as one allocated block of its start until it is released.
+    if (blk == run_end) {
+      count_alloc(GET_SIZE(blk), -1);
+      run_end += GET_SIZE(blk);
+      stats.ncoalesce++;
+      continue;
+    }
+    if (run != NULL) {
+      count_alloc(GET_SIZE(run), -1);
+      count_alloc(run_end - run, 1);
+      PUT(run, PACK(run_end - run, ALLOC | GET_PREV_ALLOC(run)));
+      release_block(run);
+    }
+    run = blk;
+    run_end = blk + GET_SIZE(blk);
+  }
+  if (run != NULL) {
+    count_alloc(GET_SIZE(run), -1);
+    count_alloc(run_end - run, 1);
+    PUT(run, PACK(run_end - run, ALLOC | GET_PREV_ALLOC(run)));
+    release_block(run);
+  }
+
+  trim_heap();
+}
+
+/// @}
+
+
+/// @name Thread caches
+/// @{
+
+/// @brief per-thread cache of freed blocks
+typedef struct __tcache {
+  void          *bin[TC_BINS];                 ///< cached payloads per bin (linked through first word)
+  unsigned int  count[TC_BINS];                ///< number of cached payloads per bin
+  unsigned long gen;                           ///< mm_generation the cache belongs to
+} TCache;
+
+static __thread TCache tcache;                         ///< cache of the calling thread
+static pthread_key_t tc_key;                           ///< key whose destructor flushes the cache on thread exit
+static pthread_once_t tc_key_once = PTHREAD_ONCE_INIT; ///< creates tc_key once
+
+#define TC_NEXT(p)         (*(void**)(p))                                       ///< next cached payload
+#define TC_KEY(p)          (*(void**)NEXT_PTR(p))                               ///< owner mark of cached payload
+
+/// @brief return the blocks in the calling thread's cache to the heap. Called on thread exit.
+static void tc_flush(void *arg)
+{
+  if (tcache.gen != mm_generation) return;
+
+  pthread_mutex_lock(&heap_lock);
+  for (int i = 0; i < TC_BINS; i++) {
+    while (tcache.bin[i] != NULL) {
+      void *p = tcache.bin[i];
+      tcache.bin[i] = TC_NEXT(p);
+      heap_free(p);
+    }
+    tcache.count[i] = 0;
+  }
+  pthread_mutex_unlock(&heap_lock);
+}
+
+/// @brief create the key used to flush thread caches on thread exit
+static void tc_key_create(void)
+{
+  if (pthread_key_create(&tc_key, tc_flush) != 0) PANIC("Cannot create thread cache key.");
+}
+
+/// @brief make sure the calling thread's cache belongs to the current heap. A cache that
+///        predates the last mm_init() is dropped (its blocks are gone with the old heap).
+static void tc_validate(void)
+{
+  if (tcache.gen == mm_generation) return;
+
+  memset(&tcache, 0, sizeof(tcache));
+  tcache.gen = mm_generation;
+  pthread_setspecific(tc_key, &tcache);
+}
+
+/// @brief bin serving requests of @a size bytes
+/// @retval int bin index
+/// @retval -1 if requests of this size are not cached
+static int tc_bin(size_t size)
+{
+  if (use_slab && (size <= SLAB_MAX)) return (size - 1) / 16;
+
+  size_t blocksize = ROUND_UP(TYPE_SIZE + size);
+  // blocks smaller than FREE_BS have no room for the owner mark (see tc_ptr_bin())
+  if ((blocksize < FREE_BS) || (blocksize > TC_MAXBLOCK)) return -1;
+  return SLAB_CLASSES + blocksize / 16;
+}
+
+/// @brief bin holding payload @a ptr
+/// @retval int bin index
+/// @retval -1 if @a ptr is not cached (too large, too small for the cache links, grown by realloc,
+///            aligned, or a block that serves no request size)
+static int tc_ptr_bin(void *ptr)
+{
+  if (use_slab && is_slab(ptr)) return SLAB_OF(ptr)->slot_size / 16 - 1;
+
+  TYPE hdr = GET_ATOMIC(PREV_PTR(ptr));
+  size_t blocksize = SIZE(hdr);
+  // aligned payloads are preceded by a pseudo header
+  if (!(hdr & ALLOC)) return -1;
+  // blocks with realloc history (slack) go back to the heap, which resets their header
+  if (hdr >> SLACK_SHIFT) return -1;
+  // the owner mark is the second payload word, which a block smaller than FREE_BS does not have
+  if ((blocksize < FREE_BS) || (blocksize > TC_MAXBLOCK)) return -1;
+  if (use_slab && (blocksize - TYPE_SIZE <= SLAB_MAX)) return -1;
+  return SLAB_CLASSES + blocksize / 16;
+}
+
+/// @brief take a payload for @a size bytes from the calling thread's cache
+/// @retval void* cached payload
+/// @retval NULL if the bin is empty
+static void* tc_get(size_t size)
+{
+  int i = tc_bin(size);
+  if (i < 0) return NULL;
+
+  tc_validate();
+  void *p = tcache.bin[i];
+  if (p != NULL) {
+    tcache.bin[i] = TC_NEXT(p);
+    tcache.count[i]--;
+    TC_KEY(p) = NULL;
+  }
+  return p;
+}
+
+/// @brief check whether payload @a ptr is in the calling thread's cache
+/// @retval 1 if @a ptr is cached
+/// @retval 0 otherwise
+static int tc_holds(void *ptr)
+{
+  // Free blocks, aligned payloads, and blocks without a second payload word are never cached
+  if (!(use_slab && is_slab(ptr))) {
+    TYPE hdr = GET_ATOMIC(PREV_PTR(ptr));
+    if (!(hdr & ALLOC) || (SIZE(hdr) < FREE_BS)) return 0;
+  }
+  if (TC_KEY(ptr) != &tcache) return 0;
+
+  for (int i = 0; i < TC_BINS; i++) {
+    for (void *p = tcache.bin[i]; p != NULL; p = TC_NEXT(p)) {
+      if (p == ptr) return 1;
+    }
+  }
+  return 0;
+}
+
+/// @brief put payload @a ptr into the calling thread's cache
+/// @retval 1 if @a ptr has been cached (or is already free)
+/// @retval 0 if @a ptr must be freed on the heap
+static int tc_put(void *ptr)
+{
+  tc_validate();
+
+  // Cached or free blocks are already taken care of
+  if (tc_holds(ptr)) return 1;
+  if (!(use_slab && is_slab(ptr)) && !(GET_ATOMIC(PREV_PTR(ptr)) & (ALLOC | ALIGNED))) return 1;
+
+  int i = tc_ptr_bin(ptr);
+  if ((i < 0) || (tcache.count[i] >= TC_COUNT)) return 0;
+
+  TC_NEXT(ptr) = tcache.bin[i];
+  TC_KEY(ptr) = &tcache;
+  tcache.bin[i] = ptr;
+  tcache.count[i]++;
+  return 1;
+}
+
+/// @brief put payload @a ptr of at least @a size bytes into the calling thread's cache. The bin
+///        is derived from @a size, the header is not read. A block may land in a bin for blocks
+///        smaller than itself; it then serves a request that is smaller than it could.
+/// @retval 1 if @a ptr has been cached
+/// @retval 0 if @a ptr must be freed on the heap
+static int tc_put_sized(void *ptr, size_t size)
+{
+  // Blocks with slack must go back to the heap (see tc_ptr_bin()), only the header knows
+  if (realloc_slack || (size == 0)) return tc_put(ptr);
+
+  int i = tc_bin(size);
+  if (i < 0) return 0;
+  // Small blocks that are not slots (shrunk by realloc) are not cached by size
+  if ((i < SLAB_CLASSES) && !is_slab(ptr)) return tc_put(ptr);
+
+  tc_validate();
+  if (tcache.count[i] >= TC_COUNT) return 0;
+
+  TC_NEXT(ptr) = tcache.bin[i];
+  TC_KEY(ptr) = &tcache;
+  tcache.bin[i] = ptr;
+  tcache.count[i]++;
+  return 1;
+}
+
+/// @}
+
+
+/// @name Heap profiler
+/// @{
+
+#define PROF_DEPTH         32                          ///< maximal number of frames recorded per sample
+
+/// @brief sampled allocation
+typedef struct __prof_sample {
+  void          *ptr;                          ///< payload (NULL: empty slot)
+  size_t        size;                          ///< requested size in bytes
+  int           depth;                         ///< number of frames in pc
+  void          *pc[PROF_DEPTH];               ///< call stack, innermost frame first
+} ProfSample;
+
+static ProfSample *prof_table = NULL;                  ///< live samples (open addressing, keyed by payload)
+static size_t prof_cap     = 0;                        ///< capacity of prof_table (power of 2)
+static size_t prof_count   = 0;                        ///< number of live samples
+static pthread_mutex_t prof_lock = PTHREAD_MUTEX_INITIALIZER; ///< protects prof_table in thread-safe mode
+static __thread long prof_countdown = 0;               ///< bytes to allocate until the next sample
+static __thread unsigned long prof_rng = 0;            ///< random number generator state (0: not seeded)
+
+/// @brief slot of payload @a ptr in prof_table
+static inline size_t prof_hash(void *ptr)
+{
+  return ((WORD(ptr) >> 4) * 0x9e3779b97f4a7c15UL) >> (64 - __builtin_ctzl(prof_cap));
+}
+
+/// @brief draw the number of bytes until the next sample from an exponential distribution with
+///        mean prof_interval (xorshift64*)
+static long prof_next(void)
+{
+  prof_rng ^= prof_rng >> 12;
+  prof_rng ^= prof_rng << 25;
+  prof_rng ^= prof_rng >> 27;
+  double u = (((prof_rng * 0x2545f4914f6cdd1dUL) >> 11) + 1) * 0x1.0p-53;  // (0, 1]
+  return (long)(-log(u) * prof_interval) + 1;
+}
+
+/// @brief put sample @a s into a free slot of prof_table
+static void prof_place(ProfSample *s)
+{
+  size_t i = prof_hash(s->ptr);
+  while (prof_table[i].ptr != NULL) i = (i + 1) & (prof_cap - 1);
+  prof_table[i] = *s;
+}
+
+/// @brief insert sample @a s into prof_table, growing it if it is half full
+static void prof_insert(ProfSample *s)
+{
+  if (2*(prof_count+1) > prof_cap) {
+    ProfSample *old = prof_table;
+    size_t oldcap = prof_cap;
+
+    prof_cap = oldcap ? 2*oldcap : 256;
+    prof_table = calloc(prof_cap, sizeof(ProfSample));
+    if (prof_table == NULL) PANIC("Out of memory for heap profile.");
+    for (size_t i = 0; i < oldcap; i++) {
+      if (old[i].ptr != NULL) prof_place(&old[i]);
+    }
+    free(old);
+  }
+
+  prof_place(s);
+  __atomic_store_n(&prof_count, prof_count + 1, __ATOMIC_RELAXED);
+}
+
+/// @brief remove the sample of payload @a ptr from prof_table, if any
+/// @retval 1 if a sample was removed, 0 otherwise
+static int prof_remove(void *ptr, ProfSample *s)
+{
+  if (prof_count == 0) return 0;
+
+  size_t i = prof_hash(ptr);
+  while ((prof_table[i].ptr != NULL) && (prof_table[i].ptr != ptr)) i = (i + 1) & (prof_cap - 1);
+  if (prof_table[i].ptr == NULL) return 0;
+  if (s != NULL) *s = prof_table[i];
+
+  // backward-shift the following entries of the cluster into the hole
+  size_t hole = i;
+  for (;;) {
+    i = (i + 1) & (prof_cap - 1);
+    if (prof_table[i].ptr == NULL) break;
+    size_t home = prof_hash(prof_table[i].ptr);
+    if (((i - home) & (prof_cap - 1)) >= ((i - hole) & (prof_cap - 1))) {
+      prof_table[hole] = prof_table[i];
+      hole = i;
+    }
+  }
+  prof_table[hole].ptr = NULL;
+  __atomic_store_n(&prof_count, prof_count - 1, __ATOMIC_RELAXED);
+  return 1;
+}
+
+/// @brief record a sample for the allocation of @a size bytes at @a ptr (called when the
+///        countdown of the calling thread expires). Must not be inlined so that the first two
+///        frames of the backtrace are this function and the API function.
+static void __attribute__((noinline)) prof_sample(void *ptr, size_t size)
+{
+  if (prof_rng == 0) {
+    prof_rng = (WORD(&prof_rng) * 0x9e3779b97f4a7c15UL) | 1;
+    prof_countdown = prof_next() - size;
+    if (prof_countdown >= 0) return;
+  }
+
+  // an allocation that spans several sampling intervals is still sampled once
+  while (prof_countdown < 0) prof_countdown += prof_next();
+
+  void *pc[PROF_DEPTH + 2];
+  int depth = backtrace(pc, PROF_DEPTH + 2) - 2;
+
+  ProfSample s = { .ptr = ptr, .size = size, .depth = MAX(depth, 0) };
+  memcpy(s.pc, &pc[2], s.depth * sizeof(void*));
+
+  if (thread_safe) pthread_mutex_lock(&prof_lock);
+  prof_insert(&s);
+  if (thread_safe) pthread_mutex_unlock(&prof_lock);
+}
+
+/// @brief count the allocation of @a size bytes at @a ptr towards the sampling interval
+static inline __attribute__((always_inline)) void prof_alloc(void *ptr, size_t size)
+{
+  if ((prof_countdown -= size) < 0) prof_sample(ptr, size);
+}
+
+/// @brief forget the sample of payload @a ptr (if any) because it is freed
+static void prof_free(void *ptr)
+{
+  if (__atomic_load_n(&prof_count, __ATOMIC_RELAXED) == 0) return;
+
+  if (thread_safe) pthread_mutex_lock(&prof_lock);
+  prof_remove(ptr, NULL);
+  if (thread_safe) pthread_mutex_unlock(&prof_lock);
+}
+
+/// @brief move the sample of payload @a ptr (if any) to @a new_ptr
+static void prof_move(void *ptr, void *new_ptr)
+{
+  ProfSample s;
+
+  if (__atomic_load_n(&prof_count, __ATOMIC_RELAXED) == 0) return;
+
+  if (thread_safe) pthread_mutex_lock(&prof_lock);
+  if (prof_remove(ptr, &s)) {
+    s.ptr = new_ptr;
+    prof_insert(&s);
+  }
+  if (thread_safe) pthread_mutex_unlock(&prof_lock);
+}
+
+/// @brief estimated number of bytes allocated for each sampled allocation of @a size bytes
+static double prof_weight(size_t size)
+{
+  // an allocation of size bytes is sampled with probability 1 - e^(-size/interval)
+  double p = -expm1(-(double)size / prof_interval);
+  return (p > 0) ? size / p : size;
+}
+
+/// @brief order samples by call stack (for qsort)
+static int prof_cmp(const void *a, const void *b)
+{
+  const ProfSample *x = a, *y = b;
+  if (x->depth != y->depth) return x->depth - y->depth;
+  return memcmp(x->pc, y->pc, x->depth * sizeof(void*));
+}
+
+/// @brief write the name of the function of frame @a sym (a backtrace_symbols() string of the form
+///        "module(function+offset) [address]") to @a f; the address if there is no name
+static void prof_putframe(FILE *f, const char *sym, void *pc)
+{
+  const char *b = strchr(sym, '(');
+  const char *e = b ? strpbrk(b, "+)") : NULL;
+  if ((b != NULL) && (e != NULL) && (e > b + 1)) fprintf(f, "%.*s", (int)(e - b - 1), b + 1);
+  else fprintf(f, "%p", pc);
+}
+
+/// @}
+
+
+static void* ff_get_free_block(size_t);
+static void* nf_get_free_block(size_t);
+static void* bf_get_free_block(size_t);
+
+void mm_init(AllocationPolicy ap)
+{
+  LOG(1, "mm_init()");
+  //
+  // set allocation policy
+  //
+  char *apstr;
+  switch (ap) {
+    case ap_FirstFit: get_free_block = ff_get_free_block; apstr = "first fit"; break;
+    case ap_NextFit:  get_free_block = nf_get_free_block; apstr = "next fit";  break;
+    case ap_BestFit:  get_free_block = bf_get_free_block; apstr = "best fit";  break;
+    default: PANIC("Invalid allocation policy.");
+  }
+  // first and best fit keep the free blocks in a tree, next fit in segregated lists
+  switch (ap) {
+    case ap_FirstFit: index_insert = at_insert; index_remove = at_remove; break;
+    case ap_BestFit:  index_insert = bt_insert; index_remove = bt_remove; break;
+    default:          index_insert = sl_insert; index_remove = sl_remove;
+  }
+  policy = ap;
+  LOG(2, "  allocation policy       %s\n", apstr);
+
+  //
+  // retrieve heap status and perform a few initial sanity checks
+  //
+  ds_heap_stat(&ds_heap_start, &ds_heap_brk, NULL);
+  PAGESIZE = ds_getpagesize();
+
+  LOG(2, "  ds_heap_start:          %p\n"
+         "  ds_heap_brk:            %p\n"
+         "  PAGESIZE:               %d\n",
+         ds_heap_start, ds_heap_brk, PAGESIZE);
+
+  if (ds_heap_start == NULL) PANIC("Data segment not initialized.");
+  if (ds_heap_start != ds_heap_brk) PANIC("Heap not clean.");
+  if ((ap == ap_FirstFit) && (WORD(ds_heap_start) > AT_PTR_MASK)) PANIC("Heap outside 48-bit address range.");
+  if (PAGESIZE == 0) PANIC("Reported pagesize == 0.");
+
+  //
+  // initialize heap
+  //
+  BS = next_bs;
+  use_slab = next_use_slab;
+  thread_safe = next_thread_safe;
+  realloc_slack = next_realloc_slack;
+  defer_coalesce = next_defer_coalesce;
+  use_madvise = next_use_madvise;
+  SHRINKTHLD = next_shrinkthld;
+  TRIM_PAD = next_trim_pad;
+  TRIM_DECAY = next_trim_decay;
+  CHUNKSIZE = next_chunksize;
+  CHUNKMAX = next_chunkmax;
+  chunk_size = CHUNKSIZE;
+  trim_age = 0;
+  prof_interval = next_prof_interval;
+  if (prof_table != NULL) memset(prof_table, 0, prof_cap * sizeof(ProfSample));
+  prof_count = 0;
+  LOG(2, "  block size granularity  %lu\n"
+         "  slab allocator          %s\n"
+         "  thread-safe mode        %s\n"
+         "  realloc slack           %s\n"
+         "  deferred coalescing     %s\n"
+         "  heap trimming           %s, high %lu, low %lu, decay %lu\n"
+         "  chunk size              %lu..%lu\n"
+         "  heap profile interval   %lu\n",
+         BS, use_slab ? "on" : "off", thread_safe ? "on" : "off", realloc_slack ? "on" : "off",
+         defer_coalesce ? "on" : "off", use_madvise ? "madvise" : "brk",
+         SHRINKTHLD, TRIM_PAD, TRIM_DECAY, CHUNKSIZE, CHUNKMAX, prof_interval);
+
+  // invalidate all thread caches
+  mm_generation++;
+  if (thread_safe) pthread_once(&tc_key_once, tc_key_create);
+
+  // SBRK as chuncksize. The heap is known to be zero if the data segment has never been used.
+  int fresh = (ds_untouched() == ds_heap_start);
+  ds_sbrk(CHUNKSIZE);
+  ds_heap_stat(&ds_heap_start, &ds_heap_brk, NULL);
+  // Get pagesize
+  PAGESIZE = ds_getpagesize();
+  // Store heap start pointer and end pointer
+  heap_start = PTR((WORD(ds_heap_start) / BS + 1) * BS);
+  heap_end = PTR(WORD(ds_heap_brk - TYPE_SIZE) / BS * BS);
+  LOG(2, "After allocate heap       \n"
+        "  ds_heap_start:          %p\n"
+        "  ds_heap_brk:            %p\n"
+        "  PAGESIZE:               %d\n",
+        "  heap_start:             %p\n",
+        "  heap_end:               %p\n",
+        ds_heap_start, ds_heap_brk, PAGESIZE, heap_start, heap_end);
+  // pre heap block (Initial sentinel half block)
+  PUT(PREV_PTR(heap_start), PACK(0, ALLOC));
+
+  // first free heap block (make header and footer for free block)
+  size_t initial_free_block_size = WORD(heap_end) - WORD(heap_start);
+  PUT(heap_start, PACK(initial_free_block_size, FREE | PREV_ALLOC) | (fresh ? ZERO : 0));
+  PUT(PREV_PTR(heap_end), PACK(initial_free_block_size, FREE));
+  // post heap block (end sentinel half block)
+  PUT(heap_end, PACK(0, ALLOC));
+  zero_mark = fresh ? NEXT_PTR(heap_end) : ds_untouched();
+
+  // empty free lists, then add the initial free block
+  memset(&stats, 0, offsetof(MMStats, search));
+#if MM_INSTRUMENT
+  ins_nfree = 0;
+  if (!ins_registered) ins_registered = (atexit(ins_dump) == 0);
+#endif
+  memset(free_list, 0, sizeof(free_list));
+  memset(next_block, 0, sizeof(next_block));
+  memset(sl_max, 0, sizeof(sl_max));
+  memset(sl_max_n, 0, sizeof(sl_max_n));
+  bt_root = at_root = NULL;
+  memset(quick_list, 0, sizeof(quick_list));
+  quick_bytes = 0;
+  fl_insert(heap_start);
+  slab_init();
+
+  //
+  // heap is initialized
+  //
+  mm_initialized = 1;
+}
+
+
+void* mm_malloc(size_t size)
+{
+  LOG(1, "mm_malloc(0x%lx)", size);
+
+  assert(mm_initialized);
+
+  // If size is zero, return null
+  if (size == 0) {
+    return NULL;
+  }
+
+  void *ptr;
+  if (!thread_safe) {
+    ptr = heap_malloc(size, NULL);
+  } else {
+    // Try the thread cache first, then the heap
+    ptr = tc_get(size);
+    if (ptr == NULL) {
+      pthread_mutex_lock(&heap_lock);
+      ptr = heap_malloc(size, NULL);
+      pthread_mutex_unlock(&heap_lock);
+    }
+  }
+
+  if (prof_interval && (ptr != NULL)) prof_alloc(ptr, size);
+  return ptr;
+}
+
+void* mm_calloc(size_t nmemb, size_t size)
+{
+  LOG(1, "mm_calloc(0x%lx, 0x%lx)", nmemb, size);
+
+  assert(mm_initialized);
+
+  // nmemb * size must not overflow
+  if ((size != 0) && (nmemb > SIZE_MAX / size)) {
+    return NULL;
+  }
+  size_t n = nmemb * size;
+  if (n == 0) {
+    return NULL;
+  }
+
+  //
+  // calloc is malloc() followed by memset(), unless the block is known to be zero
+  //
+  void *ptr;
+  int zero = 0;
+  if (!thread_safe) {
+    ptr = heap_malloc(n, &zero);
+  } else {
+    ptr = tc_get(n);
+    if (ptr == NULL) {
+      pthread_mutex_lock(&heap_lock);
+      ptr = heap_malloc(n, &zero);
+      pthread_mutex_unlock(&heap_lock);
+    }
+  }
+  if (ptr == NULL) {
+    return NULL;
+  }
+
+  if (!zero) memset(ptr, 0, n);
+
+  if (prof_interval) prof_alloc(ptr, n);
+  return ptr;
+}
+
+void* mm_memalign(size_t alignment, size_t size)
+{
+  LOG(1, "mm_memalign(0x%lx, 0x%lx)", alignment, size);
+
+  assert(mm_initialized);
+
+  // The alignment must be a power of two; zero-sized requests return null like mm_malloc()
+  if ((alignment == 0) || (alignment & (alignment - 1)) || (size == 0)) {
+    return NULL;
+  }
+
+  void *ptr;
+  if (!thread_safe) {
+    ptr = heap_memalign(alignment, size);
+  } else {
+    pthread_mutex_lock(&heap_lock);
+    ptr = heap_memalign(alignment, size);
+    pthread_mutex_unlock(&heap_lock);
+  }
+
+  if (prof_interval && (ptr != NULL)) prof_alloc(ptr, size);
+  return ptr;
+}
+
+void* mm_aligned_alloc(size_t alignment, size_t size)
+{
+  LOG(1, "mm_aligned_alloc(0x%lx, 0x%lx)", alignment, size);
+
+  // C11: the size must be a multiple of the alignment
+  if ((alignment == 0) || (size % alignment != 0)) {
+    return NULL;
+  }
+
+  return mm_memalign(alignment, size);
+}
+
+void* mm_realloc(void *ptr, size_t size)
+{
+  LOG(1, "mm_realloc(%p, 0x%lx)", ptr, size);
+
+  assert(mm_initialized);
+
+  // If prt is null, mm_malloc
+  if (ptr == NULL) {
+    return mm_malloc(size);
+  }
+
+  // If size is zero, mm_free
+  if (size == 0) {
+    mm_free(ptr);
+    return NULL;
+  }
+
+  if (thread_safe) pthread_mutex_lock(&heap_lock);
+
+  void *new_ptr = heap_realloc(ptr, size);
+
+  // A failed realloc keeps the old block and its sample. Otherwise, the sample is replaced while
+  // the heap lock is held, before another thread can reuse the old block.
+  if (prof_interval && (new_ptr != NULL)) {
+    prof_free(ptr);
+    prof_alloc(new_ptr, size);
+  }
+
+  if (thread_safe) pthread_mutex_unlock(&heap_lock);
+
+  return new_ptr;
+}
+
+void* mm_shrink_to_fit(void *ptr)
+{
+  LOG(1, "mm_shrink_to_fit(%p)", ptr);
+
+  assert(mm_initialized);
+
+  if ((ptr == NULL) || (use_slab && is_slab(ptr))) {
+    return ptr;
+  }
+
+  if (thread_safe) pthread_mutex_lock(&heap_lock);
+
+  // Forget the growth history, then shrink the block to the part in use
+  void *blk = payload_hdr(ptr);
+  size_t used_size = GET_SIZE(blk) - GET_SLACK(blk) * BS;
+  void *old_ptr = ptr;
+  if (used_size < GET_SIZE(blk)) {
+    PUT(blk, GET(blk) & (SIZE_MASK | STATUS_MASK));
+    ptr = heap_realloc(ptr, used_size - (ptr - blk));
+  }
+
+  // as in mm_realloc(), move the sample before the old block can be reused
+  if (prof_interval && (ptr != NULL) && (ptr != old_ptr)) prof_move(old_ptr, ptr);
+
+  if (thread_safe) pthread_mutex_unlock(&heap_lock);
+
+  return ptr;
+}
+
+void mm_free(void *ptr)
+{
+  LOG(1, "mm_free(%p)", ptr);
+
+  assert(mm_initialized);
+
+  // If ptr is null, return
+  if (ptr == NULL) {
+    return;
+  }
+
+  if (prof_interval) prof_free(ptr);
+
+  if (!thread_safe) {
+    heap_free(ptr);
+    return;
+  }
+
+  // Keep the block in the thread cache if there is room, otherwise free it on the heap
+  if (!tc_put(ptr)) {
+    pthread_mutex_lock(&heap_lock);
+    heap_free(ptr);
+    pthread_mutex_unlock(&heap_lock);
+  }
+}
+
+#if MM_VERIFY_SIZE
+/// @brief number of bytes of payload @a ptr in use (the part of the block that realloc
+///        preserves). Must be called with the heap lock held.
+/// @param ptr pointer to check
+/// @retval size_t bytes in use
+/// @retval 0 if @a ptr is not the payload of an allocated block or slot
+static size_t payload_used(void *ptr)
+{
+  if (use_slab && is_slab(ptr)) {
+    Slab *s = SLAB_OF(ptr);
+    size_t ofs = ptr - SLAB_SLOTS(s);
+    size_t idx = ofs / s->slot_size;
+
+    if ((ptr < SLAB_SLOTS(s)) || (ofs % s->slot_size != 0) || (idx >= s->nslots)) return 0;
+    if (s->bitmap[idx / 64] & (1UL << (idx % 64))) return 0;
+    return s->slot_size;
+  }
+
+  if ((ptr < heap_start + TYPE_SIZE) || (ptr >= heap_end) || (WORD(ptr) % TYPE_SIZE != 0)) return 0;
+
+  void *blk = payload_hdr(ptr);
+  if ((blk < heap_start) || (blk >= ptr) || (WORD(blk) % BS != 0)) return 0;
+  if (((GET(blk) & (ALLOC | QUICK)) != ALLOC) || (blk + GET_SIZE(blk) <= ptr)) return 0;
+  return blk + GET_SIZE(blk) - GET_SLACK(blk) * BS - ptr;
+}
+#endif
+
+size_t mm_usable_size(void *ptr)
+{
+  LOG(1, "mm_usable_size(%p)", ptr);
+
+  assert(mm_initialized);
+
+  // If ptr is null, return
+  if (ptr == NULL) {
+    return 0;
+  }
+
+#if MM_VERIFY_SIZE
+  if (thread_safe) pthread_mutex_lock(&heap_lock);
+  size_t used = payload_used(ptr);
+  if (thread_safe) pthread_mutex_unlock(&heap_lock);
+  if ((used == 0) || (thread_safe && (tc_validate(), tc_holds(ptr)))) {
+    PANIC("%p is not an allocated block.", ptr);
+  }
+#endif
+
+  if (use_slab && is_slab(ptr)) {
+    return SLAB_OF(ptr)->slot_size;
+  }
+
+  // Only the owner changes the header of an allocated block outside the heap lock
+  void *blk = PREV_PTR(ptr);
+  TYPE hdr = GET_ATOMIC(blk);
+  if ((hdr & (ALLOC | ALIGNED)) == ALIGNED) {
+    blk = ptr - (hdr & ~STATUS_MASK);
+    hdr = GET_ATOMIC(blk);
+  }
+
+  // The caller may use the whole block from now on, so realloc has to copy all of it
+  if ((hdr >> SLACK_SHIFT) & SLACK_MAX) {
+    if (thread_safe) pthread_mutex_lock(&heap_lock);
+    PUT(blk, GET(blk) & ~(SLACK_MAX << SLACK_SHIFT));
+    if (thread_safe) pthread_mutex_unlock(&heap_lock);
+  }
+
+  return blk + SIZE(hdr) - ptr;
+}
+
+void mm_free_sized(void *ptr, size_t size)
+{
+  LOG(1, "mm_free_sized(%p, 0x%lx)", ptr, size);
+
+  assert(mm_initialized);
+
+  // If ptr is null, return
+  if (ptr == NULL) {
+    return;
+  }
+
+#if MM_VERIFY_SIZE
+  if (thread_safe) pthread_mutex_lock(&heap_lock);
+  size_t used = payload_used(ptr);
+  int aligned = (used > 0) && !(use_slab && is_slab(ptr)) && (payload_hdr(ptr) != PREV_PTR(ptr));
+  if (thread_safe) pthread_mutex_unlock(&heap_lock);
+  if ((used == 0) || (thread_safe && (tc_validate(), tc_holds(ptr)))) {
+    PANIC("%p is not an allocated block.", ptr);
+  }
+  if (aligned) PANIC("%p has been allocated with mm_memalign().", ptr);
+  if (size > used) PANIC("Size %lu exceeds the %lu bytes of %p in use.", size, used, ptr);
+#endif
+
+  if (prof_interval) prof_free(ptr);
+
+  if (!thread_safe) {
+    heap_free(ptr);
+    return;
+  }
+
+  // Same as mm_free(), but the size picks the thread cache bin
+  if (!tc_put_sized(ptr, size)) {
+    pthread_mutex_lock(&heap_lock);
+    heap_free(ptr);
+    pthread_mutex_unlock(&heap_lock);
+  }
+}
+
+size_t mm_malloc_bulk(size_t size, size_t count, void **ptrs)
+{
+  LOG(1, "mm_malloc_bulk(0x%lx, %lu, %p)", size, count, ptrs);
 
   assert(mm_initialized);
 
-  void *current_block = heap_start;
-  // Until heap end, find free block
-  while(current_block < heap_end) { 
-    if (!GET_STATUS(current_block) && GET_SIZE(current_block) >= size) { // If there's a free block, return its pointer
-      return current_block;
+  if ((size == 0) || (count == 0)) {
+    return 0;
+  }
+
+  size_t n;
+  if (!thread_safe) {
+    n = heap_malloc_bulk(size, count, ptrs);
+  } else {
+    pthread_mutex_lock(&heap_lock);
+    n = heap_malloc_bulk(size, count, ptrs);
+    pthread_mutex_unlock(&heap_lock);
+  }
+
+  if (prof_interval) {
+    for (size_t i = 0; i < n; i++) prof_alloc(ptrs[i], size);
+  }
+  return n;
+}
+
+void mm_free_bulk(void **ptrs, size_t count)
+{
+  LOG(1, "mm_free_bulk(%p, %lu)", ptrs, count);
+
+  assert(mm_initialized);
+
+  if (prof_interval) {
+    for (size_t i = 0; i < count; i++) {
+      if (ptrs[i] != NULL) prof_free(ptrs[i]);
     }
-    // If not free block, travel next block
-    current_block += GET_SIZE(current_block);
   }
 
-  return NULL;
+  if (!thread_safe) {
+    heap_free_bulk(ptrs, count);
+  } else {
+    pthread_mutex_lock(&heap_lock);
+    heap_free_bulk(ptrs, count);
+    pthread_mutex_unlock(&heap_lock);
+  }
+}
+
+/// @name Arenas
+/// @{
+
+/// @brief arena chunk. The chunk header is followed by the chunk's data area.
+typedef struct __arena_chunk {
+  struct __arena_chunk *next;                  ///< next chunk of the arena
+  size_t               size;                   ///< size of the data area in bytes
+} ArenaChunk;
+
+/// @brief arena
+struct __arena {
+  ArenaChunk *first;                           ///< first chunk
+  ArenaChunk *cur;                             ///< chunk allocations are taken from
+  void       *top;                             ///< next free byte in cur
+  void       *end;                             ///< end of the data area of cur
+  size_t     chunksize;                        ///< data size of regular chunks in bytes
+};
+
+#define CHUNK_DATA(c)      ((void*)(c) + sizeof(ArenaChunk))                    ///< data area of chunk c
+
+/// @brief make chunk @a c the current chunk of arena @a a
+static void arena_use(Arena *a, ArenaChunk *c)
+{
+  a->cur = c;
+  a->top = CHUNK_DATA(c);
+  a->end = CHUNK_DATA(c) + c->size;
+}
+
+Arena* mm_arena_create(size_t chunksize)
+{
+  LOG(1, "mm_arena_create(0x%lx)", chunksize);
+
+  assert(mm_initialized);
+
+  Arena *a = mm_malloc(sizeof(Arena));
+  if (a == NULL) return NULL;
+
+  a->chunksize = (chunksize > 0) ? chunksize : ARENA_CHUNK;
+  a->first = mm_malloc(sizeof(ArenaChunk) + a->chunksize);
+  if (a->first == NULL) {
+    mm_free(a);
+    return NULL;
+  }
+  a->first->next = NULL;
+  a->first->size = a->chunksize;
+  arena_use(a, a->first);
+
+  return a;
+}
+
+void* mm_arena_alloc(Arena *a, size_t size)
+{
+  LOG(1, "mm_arena_alloc(%p, 0x%lx)", a, size);
+
+  if (size == 0) return NULL;
+
+  // Bump the pointer if the request fits into the current chunk
+  void *p = PTR(ALIGN_UP(WORD(a->top), ARENA_ALIGN));
+  if (p + size <= a->end) {
+    a->top = p + size;
+    return p;
+  }
+
+  // Otherwise move on to the next retained chunk that is large enough
+  ArenaChunk *c = a->cur;
+  while ((c->next != NULL) && (c->next->size < size + ARENA_ALIGN)) c = c->next;
+  if (c->next == NULL) {
+    // No such chunk, add a new one after the current chunk. Large requests get a chunk of their own.
+    size_t csize = MAX(a->chunksize, size + ARENA_ALIGN);
+    ArenaChunk *n = mm_malloc(sizeof(ArenaChunk) + csize);
+    if (n == NULL) return NULL;
+    n->size = csize;
+    n->next = a->cur->next;
+    a->cur->next = n;
+    c = n;
+  } else {
+    c = c->next;
+  }
+  arena_use(a, c);
+
+  p = PTR(ALIGN_UP(WORD(a->top), ARENA_ALIGN));
+  a->top = p + size;
+  return p;
+}
+
+void mm_arena_reset(Arena *a)
+{
+  LOG(1, "mm_arena_reset(%p)", a);
+
+  arena_use(a, a->first);
+}
+
+void mm_arena_destroy(Arena *a)
+{
+  LOG(1, "mm_arena_destroy(%p)", a);
+
+  if (a == NULL) return;
+
+  ArenaChunk *c = a->first;
+  while (c != NULL) {
+    ArenaChunk *next = c->next;
+    mm_free(c);
+    c = next;
+  }
+  mm_free(a);
+}
+
+/// @}
+
+
+/// @name block allocation policites
+/// @{
+
+/// @brief find and return a free block of at least @a size bytes (first fit)
+/// @param size size of block (including header & footer tags), in bytes
+/// @retval void* pointer to header of large enough free block
+/// @retval NULL if no free block of the requested size is avilable
+static void* ff_get_free_block(size_t size)
+{
+  LOG(1, "ff_get_free_block(1x%lx (%lu))", size, size);
+
+  assert(mm_initialized);
+
+  void *free_block = at_search(size);
+
+#if MM_VERIFY_FF
+  // Compare with a walk over all blocks in address order (fragments that are too small to be
+  // indexed are skipped)
+  void *current_block = heap_start;
+  while ((current_block < heap_end) &&
+         (GET_ALLOC(current_block) || (GET_SIZE(current_block) < MAX(size, FREE_BS)))) {
+    current_block = NEXT_BLK(current_block);
+  }
+  if (current_block == heap_end) current_block = NULL;
+  if (current_block != free_block) {
+    PANIC("First-fit tree returned %p for size %lu, heap walk %p.", free_block, size, current_block);
+  }
+#endif
+
+  return free_block;
 }
 
 /// @brief find and return a free block of at least @a size bytes (next fit)
@@ -501,27 +2834,37 @@ static void* nf_get_free_block(size_t size)
   LOG(1, "nf_get_free_block(0x%x (%lu))", size, size);
 
   assert(mm_initialized);
-  // If next block is null or over heap end, set next block as heap start
-  if (next_block == NULL || next_block >= heap_end) {
-    next_block = heap_start;
-  }
-  // Set initial next block as next block
-  void *initial_next_block = next_block;
-  // Until traveling 1 cycle, find free block
-  for(;;) {
-    // If there's free block wihch size is bigger than request one, return it's pointer
-    if (!GET_STATUS(next_block) && GET_SIZE(next_block) >= size) {
-      return next_block;
-    }
-    // If next block is allocate or small size, travel next block
-    next_block += GET_SIZE(next_block);
-    // If next block is over heap end, set as heap start
-    if (next_block >= heap_end) {
-      next_block = heap_start;
-    }
-    // If travel 1 cycle, break
-    if (next_block == initial_next_block) {
-      break;
+
+  for (int c = size_class(size); c < NUM_CLASSES; c++) {
+    if (free_list[c] == NULL) continue;
+
+    // If the rover is not set, start at the head of the list
+    if (next_block[c] == NULL) {
+      next_block[c] = free_list[c];
+    }
+    // Set initial next block as next block
+    void *initial_next_block = next_block[c];
+    // Until traveling 1 cycle of the list, find free block
+    for(;;) {
+      void *current_block = next_block[c];
+      search_visits++;
+      if (GET_SIZE(current_block) > sl_max[c]) {
+        sl_max[c] = GET_SIZE(current_block);
+        sl_max_n[c] = 1;
+      }
+      // Advance the rover, wrap around at the end of the list
+      next_block[c] = NEXT_FREE(current_block);
+      if (next_block[c] == NULL) {
+        next_block[c] = free_list[c];
+      }
+      // If there's free block wihch size is bigger than request one, return it's pointer
+      if (GET_SIZE(current_block) >= size) {
+        return current_block;
+      }
+      // If travel 1 cycle, break
+      if (next_block[c] == initial_next_block) {
+        break;
+      }
     }
   }
   // If there's no free block, return null
@@ -537,45 +2880,276 @@ static void* bf_get_free_block(size_t size)
   LOG(1, "bf_get_free_block(0x%lx (%lu))", size, size);
 
   assert(mm_initialized);
-  // Memory for pointer of best fit block
-  void *best_fit_block = NULL;
-  // Store smallest diff
-  size_t smallest_diff = SIZE_MAX;
-  // Start at heap start point
-  void *current_block = heap_start;
-  // Until heap end, travel blocks
-  while(current_block < heap_end) {
-    if (!GET_STATUS(current_block)) { // If current block is free block, check its size
-      size_t current_size = GET_SIZE(current_block);
-      if (current_size >= size) { // Check it has enough size.
-        size_t diff = current_size - size; // Check diff
-        if (diff < smallest_diff) {// If current diff is smaller than smallest diff, update best fit block and smallest diff
-          best_fit_block = current_block;
-          smallest_diff = diff;
-          if (smallest_diff == 0) { // If smallest diff is zero, return its pointer
-            break;
-          }
-        }
-      }
-    }
-    current_block += GET_SIZE(current_block);
-  }
-  // return best fit block pointer
-  return best_fit_block;
+
+  return bt_search(size);
 }
 
 /// @}
 
+/// @brief size of the largest free block. Under next fit, this is the size kept for the highest
+///        non-empty size class (see sl_remove()), which may be smaller than the largest block.
+/// @retval size_t block size in bytes (0 if there are no free blocks)
+static size_t largest_free_block(void)
+{
+  if (at_root != NULL) return at_max(at_root);
+
+  void *t = bt_root;
+  while ((t != NULL) && (BT_RIGHT(t) != NULL)) t = BT_RIGHT(t);
+  if (t != NULL) return GET_SIZE(t);
+
+  // under next fit, the largest block is in the highest non-empty size class
+  for (int c = NUM_CLASSES-1; c >= 0; c--) {
+    if (free_list[c] != NULL) return sl_max[c];
+  }
+  return 0;
+}
+
+void mm_stats(MMStats *s)
+{
+  assert(mm_initialized);
+
+  if (thread_safe) pthread_mutex_lock(&heap_lock);
+
+  *s = stats;
+  s->heap_bytes = heap_end - heap_start;
+  s->quick_bytes = quick_bytes;
+  s->live_bytes = s->heap_bytes - s->free_bytes - s->quick_bytes;
+  s->largest_free = largest_free_block();
+  s->fragmentation = s->free_bytes ? 1.0 - (double)s->largest_free / s->free_bytes : 0.0;
+
+  if (thread_safe) pthread_mutex_unlock(&heap_lock);
+}
+
+
 void mm_setloglevel(int level)
 {
   mm_loglevel = level;
 }
 
 
+void mm_setalignment(int alignment)
+{
+  if ((alignment != 16) && (alignment != 32)) PANIC("Invalid alignment %d.", alignment);
+
+  next_bs = alignment;
+}
+
+
+void mm_setslab(int active)
+{
+  next_use_slab = (active > 0);
+}
+
+
+void mm_setthreadsafe(int active)
+{
+  next_thread_safe = (active > 0);
+}
+
+
+void mm_setreallocslack(int active)
+{
+  next_realloc_slack = (active > 0);
+}
+
+void mm_setdefercoalesce(int active)
+{
+  next_defer_coalesce = (active > 0);
+}
+
+
+void mm_setmadvise(int active)
+{
+  next_use_madvise = (active > 0);
+}
+
+
+void mm_settrim(size_t high, size_t low, unsigned long decay)
+{
+  if (low > high) PANIC("Invalid trim watermarks %lu/%lu.", high, low);
+
+  next_shrinkthld = high;
+  next_trim_pad = low;
+  next_trim_decay = decay;
+}
+
+
+void mm_setprofile(size_t interval)
+{
+  next_prof_interval = interval;
+}
+
+
+int mm_profile_dump(const char *filename, ProfileFormat format)
+{
+  assert(mm_initialized);
+
+  FILE *f = fopen(filename, "w");
+  if (f == NULL) return -1;
+
+  // copy the live samples and group them by call stack
+  if (thread_safe) pthread_mutex_lock(&prof_lock);
+  size_t n = 0;
+  ProfSample *s = malloc((prof_count + 1) * sizeof(ProfSample));
+  for (size_t i = 0; (s != NULL) && (i < prof_cap); i++) {
+    if (prof_table[i].ptr != NULL) s[n++] = prof_table[i];
+  }
+  if (thread_safe) pthread_mutex_unlock(&prof_lock);
+  if (s == NULL) {
+    fclose(f);
+    return -1;
+  }
+  qsort(s, n, sizeof(ProfSample), prof_cmp);
+
+  if (format == pf_PProf) {
+    // legacy heap profile; pprof scales the sampled counts and bytes with the interval itself
+    size_t bytes = 0;
+    for (size_t i = 0; i < n; i++) bytes += s[i].size;
+    fprintf(f, "heap profile: %6lu: %8lu [%6lu: %8lu] @ heap_v2/%lu\n", n, bytes, n, bytes, prof_interval);
+  }
+
+  for (size_t i = 0, j; i < n; i = j) {
+    size_t count = 0, bytes = 0;
+    double weight = 0;
+    for (j = i; (j < n) && (prof_cmp(&s[i], &s[j]) == 0); j++) {
+      count++;
+      bytes += s[j].size;
+      weight += prof_weight(s[j].size);
+    }
+
+    if (format == pf_PProf) {
+      fprintf(f, "%6lu: %8lu [%6lu: %8lu] @", count, bytes, count, bytes);
+      for (int d = 0; d < s[i].depth; d++) fprintf(f, " %p", s[i].pc[d]);
+      fprintf(f, "\n");
+    } else {
+      // folded stacks list the outermost frame first
+      char **sym = backtrace_symbols(s[i].pc, s[i].depth);
+      for (int d = s[i].depth - 1; d >= 0; d--) {
+        if (sym != NULL) prof_putframe(f, sym[d], s[i].pc[d]);
+        else fprintf(f, "%p", s[i].pc[d]);
+        if (d > 0) fprintf(f, ";");
+      }
+      fprintf(f, " %.0f\n", weight);
+      free(sym);
+    }
+  }
+
+  if (format == pf_PProf) {
+    // pprof needs the memory map to symbolize the addresses
+    fprintf(f, "\nMAPPED_LIBRARIES:\n");
+    FILE *maps = fopen("/proc/self/maps", "r");
+    if (maps != NULL) {
+      char buf[4096];
+      size_t len;
+      while ((len = fread(buf, 1, sizeof(buf), maps)) > 0) fwrite(buf, 1, len, f);
+      fclose(maps);
+    }
+  }
+
+  free(s);
+  fclose(f);
+  return (int)n;
+}
+
+
+void mm_setchunksize(size_t min, size_t max)
+{
+  if ((min < 1024) || (max < min)) PANIC("Invalid chunk size bounds %lu/%lu.", min, max);
+
+  next_chunksize = min;
+  next_chunkmax = max;
+}
+
+
+/// @brief check the best-fit (sub-)tree rooted at @a t: all blocks must be free blocks inside the
+///        heap, ordered by (size, address) and by priority
+/// @param t root of subtree
+/// @param lo, hi all blocks in the subtree must lie strictly between @a lo and @a hi (NULL: none)
+/// @param depth depth of @a t
+/// @param limit stop after visiting @a limit blocks (protects against cycles)
+/// @param[in,out] n number of visited blocks
+/// @param[in,out] maxdepth depth of the tree
+/// @retval long number of errors
+static long bt_check(void *t, void *lo, void *hi, int depth, long limit, long *n, int *maxdepth)
+{
+  if (t == NULL) return 0;
+  if ((t < heap_start) || (t >= heap_end)) {
+    printf("    --> ERROR: best-fit tree: block %p outside heap\n", t);
+    return 1;
+  }
+  if (++*n > limit) return 0;
+  if (depth > *maxdepth) *maxdepth = depth;
+
+  long errors = 0;
+  if (GET_ALLOC(t)) {
+    errors++;
+    printf("    --> ERROR: best-fit tree: block %p is not free\n", t);
+  }
+  if (((lo != NULL) && !bt_less(lo, t)) || ((hi != NULL) && !bt_less(t, hi))) {
+    errors++;
+    printf("    --> ERROR: best-fit tree: block %p out of order\n", t);
+  }
+  void *l = BT_LEFT(t), *r = BT_RIGHT(t);
+  if (((l != NULL) && (bt_prio(l) > bt_prio(t))) || ((r != NULL) && (bt_prio(r) > bt_prio(t)))) {
+    errors++;
+    printf("    --> ERROR: best-fit tree: block %p violates the heap order\n", t);
+  }
+
+  errors += bt_check(l, lo, t, depth + 1, limit, n, maxdepth);
+  errors += bt_check(r, t, hi, depth + 1, limit, n, maxdepth);
+  return errors;
+}
+
+/// @brief check the first-fit (sub-)tree rooted at @a t: all blocks must be free blocks inside
+///        the heap, ordered by address and by priority, and record the largest size in their
+///        subtree
+/// @param t root of subtree
+/// @param lo, hi all blocks in the subtree must lie strictly between @a lo and @a hi (NULL: none)
+/// @param depth depth of @a t
+/// @param limit stop after visiting @a limit blocks (protects against cycles)
+/// @param[in,out] n number of visited blocks
+/// @param[in,out] maxdepth depth of the tree
+/// @retval long number of errors
+static long at_check(void *t, void *lo, void *hi, int depth, long limit, long *n, int *maxdepth)
+{
+  if (t == NULL) return 0;
+  if ((t < heap_start) || (t >= heap_end)) {
+    printf("    --> ERROR: first-fit tree: block %p outside heap\n", t);
+    return 1;
+  }
+  if (++*n > limit) return 0;
+  if (depth > *maxdepth) *maxdepth = depth;
+
+  long errors = 0;
+  if (GET_ALLOC(t)) {
+    errors++;
+    printf("    --> ERROR: first-fit tree: block %p is not free\n", t);
+  }
+  if (((lo != NULL) && (t <= lo)) || ((hi != NULL) && (t >= hi))) {
+    errors++;
+    printf("    --> ERROR: first-fit tree: block %p out of order\n", t);
+  }
+  void *l = at_left(t), *r = at_right(t);
+  if (((l != NULL) && (bt_prio(l) > bt_prio(t))) || ((r != NULL) && (bt_prio(r) > bt_prio(t)))) {
+    errors++;
+    printf("    --> ERROR: first-fit tree: block %p violates the heap order\n", t);
+  }
+  if (at_max(t) != MAX(GET_SIZE(t), MAX(at_max(l), at_max(r)))) {
+    errors++;
+    printf("    --> ERROR: first-fit tree: block %p records wrong subtree maximum %lx\n", t, at_max(t));
+  }
+
+  errors += at_check(l, lo, t, depth + 1, limit, n, maxdepth);
+  errors += at_check(r, t, hi, depth + 1, limit, n, maxdepth);
+  return errors;
+}
+
 void mm_check(void)
 {
   assert(mm_initialized);
 
+  if (thread_safe) pthread_mutex_lock(&heap_lock);
+
   void *p;
   char *apstr;
   if (get_free_block == ff_get_free_block) apstr = "first fit";
@@ -589,48 +3163,97 @@ void mm_check(void)
   printf("  heap_start:             %p\n", heap_start);
   printf("  heap_end:               %p\n", heap_end);
   printf("  allocation policy:      %s\n", apstr);
-  printf("  next_block:             %p\n", next_block);
+  printf("  block size granularity: %lu\n", BS);
+  printf("  slab allocator:         %s\n", use_slab ? "on" : "off");
+  printf("  thread-safe mode:       %s\n", thread_safe ? "on" : "off");
+  printf("  realloc slack:          %s\n", realloc_slack ? "on" : "off");
+  printf("  deferred coalescing:    %s\n", defer_coalesce ? "on" : "off");
+  printf("  heap trimming:          %s, high %lu, low %lu, decay %lu\n",
+         use_madvise ? "madvise" : "brk", SHRINKTHLD, TRIM_PAD, TRIM_DECAY);
+  printf("  chunk size:             %lu (%lu..%lu)\n", chunk_size, CHUNKSIZE, CHUNKMAX);
 
   printf("\n");
   p = PREV_PTR(heap_start);
   printf("  initial sentinel:       %p: size: %6lx (%7ld), status: %s\n",
-         p, GET_SIZE(p), GET_SIZE(p), GET_STATUS(p) == ALLOC ? "allocated" : "free");
+         p, GET_SIZE(p), GET_SIZE(p), GET_ALLOC(p) ? "allocated" : "free");
   p = heap_end;
   printf("  end sentinel:           %p: size: %6lx (%7ld), status: %s\n",
-         p, GET_SIZE(p), GET_SIZE(p), GET_STATUS(p) == ALLOC ? "allocated" : "free");
+         p, GET_SIZE(p), GET_SIZE(p), GET_ALLOC(p) ? "allocated" : "free");
   printf("\n");
   printf("  blocks:\n");
 
   printf("    %-14s  %8s  %10s  %10s  %8s  %s\n", "address", "offset", "size (hex)", "size (dec)", "payload", "status");
 
   long errors = 0;
+  long nfree = 0;
+  long nquick = 0;
+  size_t fbytes = 0;
+  unsigned long fcount[NUM_CLASSES] = { 0 };
+  unsigned long acount[NUM_CLASSES] = { 0 };
+  TYPE prev_status = ALLOC;
   p = heap_start;
   while (p < heap_end) {
     char *ofs_str, *size_str;
 
     TYPE hdr = GET(p);
     TYPE size = SIZE(hdr);
-    TYPE status = STATUS(hdr);
+    TYPE status = hdr & ALLOC;
 
     if (asprintf(&ofs_str, "0x%lx", p-heap_start) < 0) ofs_str = NULL;
     if (asprintf(&size_str, "0x%lx", size) < 0) size_str = NULL;
-    printf("    %p  %8s  %10s  %10ld  %8ld  %s\n",
-           p, ofs_str, size_str, size, size-2*TYPE_SIZE, status == ALLOC ? "allocated" : "free");
+    printf("    %p  %8s  %10s  %10ld  %8ld  %s",
+           p, ofs_str, size_str, size, size-(status == ALLOC ? 1 : 2)*TYPE_SIZE,
+           status == FREE ? ((hdr & ZERO) ? "free (zero)" : "free") : (hdr & QUICK) ? "quick" : "allocated");
+    if (hdr & QUICK) nquick++;
+    if (status == ALLOC) acount[size_class(size)]++;
+    if ((status == ALLOC) && (GET_GROWTH(p) > 0)) {
+      printf(" (slack: %ld, grown %ld times)", GET_SLACK(p) * BS, GET_GROWTH(p));
+    }
+    printf("\n");
 
     free(ofs_str);
     free(size_str);
 
-    void *fp = p + size - TYPE_SIZE;
-    TYPE ftr = GET(fp);
-    TYPE fsize = SIZE(ftr);
-    TYPE fstatus = STATUS(ftr);
-
-    if ((size != fsize) || (status != fstatus)) {
+    // the PREV_ALLOC flag must reflect the status of the preceding block
+    if (((hdr & PREV_ALLOC) != 0) != (prev_status == ALLOC)) {
       errors++;
-      printf("    --> ERROR: footer at %p with different properties: size: %lx, status: %lx\n", 
-             fp, fsize, fstatus);
-      mm_panic("mm_check");
+      printf("    --> ERROR: PREV_ALLOC flag of block at %p does not match status of previous block\n", p);
+    }
+
+    // only free blocks have a footer
+    if (status == FREE) {
+      void *fp = p + size - TYPE_SIZE;
+      TYPE ftr = GET(fp);
+      TYPE fsize = SIZE(ftr);
+      TYPE fstatus = STATUS(ftr);
+
+      if ((size != fsize) || (status != fstatus)) {
+        errors++;
+        printf("    --> ERROR: footer at %p with different properties: size: %lx, status: %lx\n",
+               fp, fsize, fstatus);
+        mm_panic("mm_check");
+      }
+
+      // a known-zero block must be zero except for its boundary tags and link words
+      if (hdr & ZERO) {
+        for (TYPE *w = p + FREE_BS - TYPE_SIZE; (void*)w < fp; w++) {
+          if (*w != 0) {
+            errors++;
+            printf("    --> ERROR: known-zero free block at %p not zero at %p\n", p, w);
+            break;
+          }
+        }
+      }
+
+      if (size >= FREE_BS) nfree++;
+      fbytes += size;
+      fcount[size_class(size)]++;
+      if (!GET_ALLOC(p + size)) {
+        errors++;
+        printf("    --> ERROR: free block at %p not coalesced with next block\n", p);
+      }
     }
+    prev_status = status;
 
     p = p + size;
     if (size == 0) {
@@ -638,8 +3261,179 @@ void mm_check(void)
       break;
     }
   }
+  int coherent = (p == heap_end);
+  if (coherent && (((GET(heap_end) & PREV_ALLOC) != 0) != (prev_status == ALLOC))) {
+    errors++;
+    printf("    --> ERROR: PREV_ALLOC flag of end sentinel does not match status of last block\n");
+  }
+
+  //
+  // free lists: every listed block must be a free block of the list's size class, the links
+  // must be consistent, and every free block in the heap must be listed exactly once. The size
+  // kept as the largest of a class (next fit) must be the size of a listed block.
+  //
+  printf("\n");
+  printf("  free lists:\n");
+  long nlisted = 0;
+  for (int c = 0; c < NUM_CLASSES; c++) {
+    long n = 0, nmax = 0;
+    void *prev = NULL;
+    for (p = free_list[c]; p != NULL; prev = p, p = NEXT_FREE(p)) {
+      if ((p < heap_start) || (p >= heap_end)) {
+        errors++;
+        printf("    --> ERROR: class %d: block %p outside heap\n", c, p);
+        break;
+      }
+      if (GET_ALLOC(p)) {
+        errors++;
+        printf("    --> ERROR: class %d: block %p is not free\n", c, p);
+      }
+      if (size_class(GET_SIZE(p)) != c) {
+        errors++;
+        printf("    --> ERROR: class %d: block %p of size %lx in wrong class\n", c, p, GET_SIZE(p));
+      }
+      if (PREV_FREE(p) != prev) {
+        errors++;
+        printf("    --> ERROR: class %d: block %p has inconsistent prev link\n", c, p);
+      }
+      if (GET_SIZE(p) == sl_max[c]) nmax++;
+      if (++n > nfree) break;
+    }
+    if ((n > 0) && ((nmax == 0) || (nmax < (long)sl_max_n[c]))) {
+      errors++;
+      printf("    --> ERROR: class %d: %ld listed blocks of size %lu, but %lu kept as largest\n",
+             c, nmax, sl_max[c], sl_max_n[c]);
+    }
+    if (n > 0) printf("    class %2d (>= %7lu bytes): %ld blocks\n", c, BS << c, n);
+    nlisted += n;
+  }
+  if (bt_root != NULL) {
+    long n = 0;
+    int depth = 0;
+    errors += bt_check(bt_root, NULL, NULL, 1, nfree, &n, &depth);
+    printf("    best-fit tree: %ld blocks, depth %d\n", n, depth);
+    nlisted += n;
+  }
+  if (at_root != NULL) {
+    long n = 0;
+    int depth = 0;
+    errors += at_check(at_root, NULL, NULL, 1, nfree, &n, &depth);
+    printf("    first-fit tree: %ld blocks, depth %d\n", n, depth);
+    nlisted += n;
+  }
+  if (nlisted != nfree) {
+    errors++;
+    printf("    --> ERROR: %ld free blocks in heap, but %ld in free lists\n", nfree, nlisted);
+  }
+
+  //
+  // quick lists: every listed block must be a quick-listed block of the list's size, and every
+  // quick-listed block in the heap must be listed exactly once
+  //
+  if (defer_coalesce) {
+    printf("\n");
+    printf("  quick lists:\n");
+    long nlisted = 0;
+    size_t bytes = 0;
+    for (int i = 0; i < QL_BINS; i++) {
+      long n = 0;
+      for (p = quick_list[i]; p != NULL; p = NEXT_FREE(p)) {
+        if ((p < heap_start) || (p >= heap_end)) {
+          errors++;
+          printf("    --> ERROR: quick list %d: block %p outside heap\n", i, p);
+          break;
+        }
+        if ((GET_STATUS(p) & (ALLOC | QUICK)) != (ALLOC | QUICK) || (GET_SIZE(p) != (size_t)i * 16)) {
+          errors++;
+          printf("    --> ERROR: quick list %d: block %p is not a quick-listed block of %d bytes\n", i, p, i * 16);
+        }
+        bytes += GET_SIZE(p);
+        if (++n > nquick) break;
+      }
+      if (n > 0) printf("    %4d bytes: %ld blocks\n", i * 16, n);
+      nlisted += n;
+    }
+    if ((nlisted != nquick) || (bytes != quick_bytes)) {
+      errors++;
+      printf("    --> ERROR: %ld quick-listed blocks in heap, but %ld (%lu bytes, expected %lu) in quick lists\n",
+             nquick, nlisted, bytes, quick_bytes);
+    }
+  }
+
+  //
+  // slabs: the slot bitmap must agree with the free slot count, and partially used slabs must
+  // be in the partial list of their class
+  //
+  if (use_slab) {
+    printf("\n");
+    printf("  slabs:\n");
+    for (size_t unit = 0; unit < slab_units; unit++) {
+      if ((slab_map[unit / 8] & (1 << (unit % 8))) == 0) continue;
+
+      Slab *s = slab_base + unit * SLAB_SIZE;
+      size_t nset = 0;
+      for (size_t w = 0; w < sizeof(s->bitmap) / sizeof(s->bitmap[0]); w++) {
+        nset += __builtin_popcountl(s->bitmap[w]);
+      }
+      printf("    %p  slot size: %3lu, used: %3lu / %3lu\n",
+             s, s->slot_size, s->nslots - s->nfree, s->nslots);
+      if (nset != s->nfree) {
+        errors++;
+        printf("    --> ERROR: slab %p: %lu free slots in bitmap, but nfree is %lu\n", s, nset, s->nfree);
+      }
+      if ((GET_SIZE(s->blk) < (void*)s + SLAB_SIZE - s->blk) || !GET_ALLOC(s->blk)) {
+        errors++;
+        printf("    --> ERROR: slab %p: not covered by allocated block %p\n", s, s->blk);
+      }
+      if (s->nfree > 0) {
+        Slab *q = slab_partial[s->slot_size / 16 - 1];
+        while ((q != NULL) && (q != s)) q = q->next;
+        if (q == NULL) {
+          errors++;
+          printf("    --> ERROR: slab %p with free slots not in partial list\n", s);
+        }
+      }
+    }
+  }
+
+  //
+  // statistics: the incrementally maintained counters must agree with the heap
+  //
+  printf("\n");
+  printf("  statistics:\n");
+  printf("    free: %lu bytes, largest %lu, splits: %lu, coalesces: %lu, grown: %lu, trimmed: %lu, "
+         "zeroed callocs: %lu\n", stats.free_bytes, largest_free_block(), stats.nsplit, stats.ncoalesce,
+         stats.ngrow, stats.nshrink, stats.nzero);
+  if (coherent && ((fbytes != stats.free_bytes) || memcmp(fcount, stats.free_blocks, sizeof(fcount)))) {
+    errors++;
+    printf("    --> ERROR: %lu free bytes in heap, but %lu in statistics\n", fbytes, stats.free_bytes);
+    for (int c = 0; c < NUM_CLASSES; c++) {
+      if (fcount[c] != stats.free_blocks[c]) {
+        printf("    --> ERROR: class %d: %lu free blocks in heap, but %lu in statistics\n",
+               c, fcount[c], stats.free_blocks[c]);
+      }
+    }
+  }
+  if (coherent && memcmp(acount, stats.alloc_blocks, sizeof(acount))) {
+    errors++;
+    for (int c = 0; c < NUM_CLASSES; c++) {
+      if (acount[c] != stats.alloc_blocks[c]) {
+        printf("    --> ERROR: class %d: %lu allocated blocks in heap, but %lu in statistics\n",
+               c, acount[c], stats.alloc_blocks[c]);
+      }
+    }
+  }
 
   printf("\n");
-  if ((p == heap_end) && (errors == 0)) printf("  Block structure coherent.\n");
+  if (thread_safe) {
+    size_t ncached = 0;
+    if (tcache.gen == mm_generation) {
+      for (int i = 0; i < TC_BINS; i++) ncached += tcache.count[i];
+    }
+    printf("  thread cache: %lu blocks cached by this thread (shown as allocated).\n", ncached);
+  }
+  if (coherent && (errors == 0)) printf("  Block structure coherent.\n");
   printf("-------------------------------------------------------------------------------------------------\n");
+
+  if (thread_safe) pthread_mutex_unlock(&heap_lock);
 }
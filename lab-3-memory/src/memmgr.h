@@ -43,6 +43,40 @@ typedef enum {
   ap_BestFit,                     ///< best fit allocation policy
 } AllocationPolicy;
 
+#define MM_NUM_CLASSES    20      ///< number of block size classes in MMStats
+#define MM_SEARCH_BINS    16      ///< number of bins of the search length histograms in MMStats
+
+/// @brief heap statistics (see mm_stats()). Sizes are block sizes including boundary tags. The
+///        counters are reset by mm_init(), except for the search length histograms.
+typedef struct __mmstats {
+  size_t        heap_bytes;       ///< size of the heap (between the sentinels)
+  size_t        live_bytes;       ///< bytes in allocated blocks (including slabs and cached blocks)
+  size_t        free_bytes;       ///< bytes in free blocks
+  size_t        quick_bytes;      ///< bytes in quick-listed blocks (deferred coalescing)
+  size_t        largest_free;     ///< size of the largest free block (under next fit, possibly of a
+                                  ///< smaller one in the same size class, see mm_stats())
+  double        fragmentation;    ///< external fragmentation: 1 - largest_free / free_bytes
+  unsigned long free_blocks[MM_NUM_CLASSES]; ///< free blocks per size class. Class i holds blocks
+                                  ///< of [BS << i, BS << (i+1)) bytes; the last class is open.
+  unsigned long alloc_blocks[MM_NUM_CLASSES]; ///< allocated blocks per size class, including slabs
+                                  ///< and quick-listed and thread-cached blocks
+  unsigned long nsplit;           ///< number of free blocks split by an allocation or realloc
+  unsigned long ncoalesce;        ///< number of free blocks merged with a free neighbour
+  unsigned long ngrow;            ///< number of heap expansions
+  unsigned long nshrink;          ///< number of heap trims
+  unsigned long nzero;            ///< number of calloc requests served from known-zero memory (no memset)
+  unsigned long search[3][MM_SEARCH_BINS]; ///< free block searches per allocation policy by the
+                                  ///< number of blocks visited. Bin 0 counts searches that visit
+                                  ///< no block, bin i [2^(i-1), 2^i) blocks; the last bin is open.
+                                  ///< Accumulated over all mm_init() calls.
+} MMStats;
+
+/// @brief heap profile formats (see mm_profile_dump())
+typedef enum {
+  pf_Folded,                      ///< folded stacks with estimated bytes (flame graph input)
+  pf_PProf,                       ///< legacy pprof heap profile
+} ProfileFormat;
+
 /// @brief initialize heap. Must be called before any of the other functions can be used.
 void mm_init(AllocationPolicy ap);
 
@@ -56,9 +90,25 @@ void* mm_malloc(size_t size);
 /// @param nelem number of elements
 /// @param size size of one element in bytes
 /// @retval void* pointer to first byte of zeroed memory on success
-/// @retval NULL if memory allocation failed
+/// @retval NULL if memory allocation failed or @a nelem * @a size overflows
 void* mm_calloc(size_t nelem, size_t size);
 
+/// @brief allocate a block of memory of @a size bytes starting at an address aligned to
+///        @a alignment. The misaligned part in front of the block remains free.
+/// @param alignment alignment in bytes (power of 2, e.g., 64, 4096, or 2 MB)
+/// @param size requested size in bytes
+/// @retval void* pointer to first byte of memory on success
+/// @retval NULL if memory allocation failed or @a alignment is not a power of 2
+void* mm_memalign(size_t alignment, size_t size);
+
+/// @brief C11 aligned_alloc(): like mm_memalign(), but @a size must be a multiple of
+///        @a alignment.
+/// @param alignment alignment in bytes (power of 2)
+/// @param size requested size in bytes (multiple of @a alignment)
+/// @retval void* pointer to first byte of memory on success
+/// @retval NULL if memory allocation failed or the arguments are invalid
+void* mm_aligned_alloc(size_t alignment, size_t size);
+
 /// @brief re-allocate a block of memory to change its size to @a size bytes.
 /// @param ptr previously allocated block or NULL
 /// @param size requested new size in bytes
@@ -66,14 +116,161 @@ void* mm_calloc(size_t nelem, size_t size);
 /// @retval NULL if memory allocation failed
 void* mm_realloc(void *ptr, size_t size);
 
+/// @brief give back the slack that realloc slack mode has added to block @a ptr. The block may
+///        move if it cannot be shrunk in place.
+/// @param ptr previously allocated block or NULL
+/// @retval void* pointer to first byte of the block
+void* mm_shrink_to_fit(void *ptr);
+
 /// @brief free a previously allocated block of memory
-/// @param ptr pointer to allocated memory obtained by calling mm_malloc, mm_calloc, or mm_realloc
+/// @param ptr pointer to allocated memory obtained by calling mm_malloc, mm_calloc, mm_realloc,
+///        mm_memalign, or mm_aligned_alloc
 void mm_free(void *ptr);
 
+/// @brief number of bytes that can be used at @a ptr. This can be more than was requested; the
+///        caller may use all of them without calling mm_realloc(), which then preserves them.
+/// @param ptr pointer to allocated memory or NULL
+/// @retval size_t usable size in bytes (0 if @a ptr is NULL)
+size_t mm_usable_size(void *ptr);
+
+/// @brief free a previously allocated block of memory whose size is known to the caller. In
+///        thread-safe mode, the size selects the thread cache without reading the block header.
+///        Checked when built with MM_VERIFY_SIZE=1.
+/// @param ptr pointer to allocated memory obtained by calling mm_malloc, mm_calloc, mm_realloc,
+///        or mm_malloc_bulk (not mm_memalign or mm_aligned_alloc), or NULL
+/// @param size size passed to the call that returned @a ptr, or any size up to the result of
+///        mm_usable_size(@a ptr)
+void mm_free_sized(void *ptr, size_t size);
+
+/// @brief allocate @a count blocks of @a size bytes each with one search of the free block index.
+///        The blocks are carved out of one free run; each of them can be freed or reallocated on
+///        its own.
+/// @param size requested size per block in bytes
+/// @param count number of blocks
+/// @param[out] ptrs array of at least @a count entries that receives the payload pointers
+/// @retval size_t number of blocks allocated (less than @a count if memory allocation failed)
+size_t mm_malloc_bulk(size_t size, size_t count, void **ptrs);
+
+/// @brief free @a count blocks at once. Runs of adjacent blocks are coalesced in one pass.
+/// @param ptrs pointers to allocated memory (NULL entries are skipped). The array is sorted by
+///        address.
+/// @param count number of pointers
+void mm_free_bulk(void **ptrs, size_t count);
+
+/// @brief arena for objects that are released all at once. Arenas live on the heap; they become
+///        invalid when mm_init() is called. An arena must not be used by several threads at once.
+typedef struct __arena Arena;
+
+/// @brief create an arena
+/// @param chunksize size of the chunks the arena obtains from the heap in bytes (0: default)
+/// @retval Arena* new arena on success
+/// @retval NULL if memory allocation failed
+Arena* mm_arena_create(size_t chunksize);
+
+/// @brief allocate @a size bytes from arena @a a. The memory is 16-byte aligned and remains valid
+///        until the arena is reset or destroyed; it cannot be passed to mm_free() or mm_realloc().
+/// @param a arena
+/// @param size requested size in bytes
+/// @retval void* pointer to first byte of memory on success
+/// @retval NULL if memory allocation failed
+void* mm_arena_alloc(Arena *a, size_t size);
+
+/// @brief release all allocations of arena @a a in O(1). The arena keeps its chunks for reuse.
+/// @param a arena
+void mm_arena_reset(Arena *a);
+
+/// @brief destroy arena @a a and return its memory to the heap
+/// @param a arena or NULL
+void mm_arena_destroy(Arena *a);
+
 /// @brief set log level
 /// @brief level log level (0: no logging, 1: info; 2: verbose)
 void mm_setloglevel(int level);
 
+/// @brief set block size granularity & alignment. Takes effect at the next call to mm_init().
+///        The default is set at build time with MM_ALIGNMENT (32 if not defined).
+/// @param alignment block alignment in bytes (16 or 32)
+void mm_setalignment(int alignment);
+
+/// @brief turn the slab allocator for small requests (<= 64 bytes) on/off. Takes effect at the
+///        next call to mm_init(). The default is set at build time with MM_SLAB (0 if not defined).
+/// @param active (1: slab allocator active, 0: all requests served from the heap)
+void mm_setslab(int active);
+
+/// @brief turn thread-safe mode on/off. In thread-safe mode, the memory manager may be called
+///        from several threads concurrently; heap operations are serialized by a global lock and
+///        each thread caches a few freed blocks per size. Takes effect at the next call to
+///        mm_init(), which must not run concurrently with other calls. The default is set at
+///        build time with MM_THREADSAFE (0 if not defined).
+/// @param active (1: thread-safe mode, 0: single-threaded)
+void mm_setthreadsafe(int active);
+
+/// @brief turn realloc slack mode on/off. In this mode, blocks grown by mm_realloc() are
+///        over-allocated geometrically so that subsequent growth usually happens in place;
+///        mm_shrink_to_fit() returns the slack. Takes effect at the next call to mm_init(). The
+///        default is set at build time with MM_REALLOC_SLACK (0 if not defined).
+/// @param active (1: over-allocate growing blocks, 0: allocate exactly)
+void mm_setreallocslack(int active);
+
+/// @brief turn deferred coalescing on/off. In this mode, freed blocks of up to 512 bytes are kept
+///        in quick lists (one per block size) and reused for requests of the same size; they are
+///        merged with their neighbours in a batch when an allocation finds no free block or the
+///        quick lists hold more than 64 KB. Takes effect at the next call to mm_init(). The default
+///        is set at build time with MM_DEFER_COALESCE (0 if not defined).
+/// @param active (1: deferred coalescing, 0: immediate coalescing)
+void mm_setdefercoalesce(int active);
+
+/// @brief select how free memory is returned to the data segment. By default, the free block at
+///        the end of the heap is trimmed by moving brk down. In madvise mode, brk is never moved
+///        down; instead, the pages of large free blocks anywhere in the heap are released with
+///        madvise(MADV_DONTNEED). Takes effect at the next call to mm_init(). The default is set
+///        at build time with MM_MADVISE (0 if not defined).
+/// @param active (1: madvise, 0: move brk)
+void mm_setmadvise(int active);
+
+/// @brief set the heap trimming parameters. The heap is trimmed when the free block at its end
+///        reaches @a high bytes, or when it exceeds @a low bytes and the heap has not grown for
+///        @a decay allocations and frees; a trim leaves @a low bytes at the end of the heap. In
+///        madvise mode, free blocks of at least @a high bytes are discarded except for their
+///        first @a low bytes. Takes effect at the next call to mm_init(). The defaults are 64 KB,
+///        16 KB, and 1024 operations.
+/// @param high high watermark in bytes
+/// @param low low watermark in bytes (<= @a high)
+/// @param decay number of heap operations
+void mm_settrim(size_t high, size_t low, unsigned long decay);
+
+/// @brief set the bounds of the heap growth unit. The heap grows by at least the current chunk
+///        size, which doubles (up to 1/8 of the heap) when the heap grows again within 256 heap
+///        operations and is halved by trims and by a growth after a long pause. Takes effect at
+///        the next call to mm_init(). The defaults are 1 KB and 1 MB; @a min == @a max gives a
+///        fixed chunk size.
+/// @param min smallest chunk size in bytes (>= 1024)
+/// @param max largest chunk size in bytes (>= @a min)
+void mm_setchunksize(size_t min, size_t max);
+
+/// @brief turn the sampling heap profiler on/off. When on, on average one allocation every
+///        @a interval allocated bytes (mm_malloc(), mm_calloc(), mm_realloc()) is sampled with
+///        its call stack until it is freed. Takes effect at the next call to mm_init(). The default
+///        is set at build time with MM_PROFILE (0 if not defined).
+/// @param interval mean sampling interval in bytes (0: off)
+void mm_setprofile(size_t interval);
+
+/// @brief write the live samples of the heap profiler to @a filename. Call stacks are symbolized
+///        with backtrace_symbols(), which requires linking with -rdynamic.
+/// @param filename output file
+/// @param format pf_Folded: one line "outermost;...;innermost bytes" per call stack with the
+///        estimated live bytes; pf_PProf: legacy pprof heap profile with the memory map
+/// @retval int number of live samples written
+/// @retval -1 on error
+int mm_profile_dump(const char *filename, ProfileFormat format);
+
+/// @brief retrieve heap statistics. The counters are maintained incrementally; only the largest
+///        free block is looked up: O(1) under first and next fit, O(log n) under best fit. Under
+///        next fit, the size kept for the highest non-empty size class can be stale after its
+///        largest block was taken; it is then the size of another block of that class.
+/// @param[out] stats statistics
+void mm_stats(MMStats *stats);
+
 /// @brief dump heap and perform some sanity checks
 void mm_check(void);
 
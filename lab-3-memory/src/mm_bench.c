@@ -0,0 +1,477 @@
+//--------------------------------------------------------------------------------------------------
+// System Programming                       Memory Lab                                    Fall 2023
+//
+/// @file
+/// @brief trace replay benchmark for the dynamic memory manager
+/// @author Hyunwoo LEE
+/// @studid 2020-12907
+//--------------------------------------------------------------------------------------------------
+
+
+// Trace replay benchmark
+// ======================
+// mm_bench replays the allocation sequences in .dmas script files (the format read by mm_driver)
+// directly against memmgr.c and reports performance and utilization metrics.
+//
+// Supported script commands:
+// - dataseg <size>        size of the data segment
+// - m <id> <size>         malloc
+// - c <id> <size>         calloc
+// - a <id> <align> <size> memalign (not understood by mm_driver)
+// - M <id> <count> <size> bulk malloc of ids id..id+count-1 (not understood by mm_driver)
+// - F <id> <count>        bulk free of ids id..id+count-1 (not understood by mm_driver)
+// - r <id> <size>         realloc
+// - f <id>                free (id -1: free(NULL))
+// - v                     validate; runs mm_check() if mm_bench is invoked with -c
+// - heap, mode, log, start, stop, stat  ignored (all policies are measured, see -p)
+//
+// Each trace is run N times per allocation policy on a fresh data segment. Metrics:
+// - throughput: number of operations / accumulated time spent in the memory manager. A bulk
+//               command counts as one operation per block.
+// - p50/p99:    per-operation latency over all runs (per command for bulk commands)
+// - peak heap:  largest heap size (brk - heap start) observed after an operation
+// - peak live:  largest sum of live payload sizes
+// - util:       peak live / peak heap
+// - sbrk:       number of non-zero ds_sbrk() calls in one run
+// - mprotect:   number of mprotect() calls in one run
+// - madvise:    number of madvise() calls in one run (madvise trimming mode, see -m)
+//
+// With -P, allocations are sampled by the heap profiler. After the last run of each trace and
+// policy, the live heap profile is written to a file as folded stacks (the file holds the profile
+// of the last trace and policy), and the estimated live bytes are compared to the actual ones.
+//
+// With -z, f commands call mm_free_sized() with the size of the last m, c, or r command of the
+// block (mm_free() for blocks allocated with a).
+//
+// With -S, the heap statistics (mm_stats()) at the end of the last run and the search length
+// histogram over all runs are printed below each result.
+//
+// With -c, payloads are verified outside the timed calls: every block is filled with a pattern
+// derived from its id and the byte offset. calloc'ed blocks must be zero, a realloc must preserve
+// the pattern up to the smaller of the old and the new size, and a block must still hold it when
+// it is freed.
+//
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "dataseg.h"
+#include "memmgr.h"
+
+
+/// @brief trace operation
+typedef struct __op {
+  char   type;                    ///< operation (m, c, a, r, f, M, F, v)
+  int    id;                      ///< block id (first block id for M, F)
+  size_t size;                    ///< requested size in bytes
+  size_t align;                   ///< alignment in bytes (a only)
+  int    count;                   ///< number of blocks (M, F only)
+} Op;
+
+/// @brief trace
+typedef struct __trace {
+  const char *name;               ///< file name
+  size_t     dssize;              ///< data segment size
+  Op         *op;                 ///< operations
+  size_t     nops;                ///< number of operations (including validations)
+  int        maxid;               ///< largest block id
+} Trace;
+
+/// @brief benchmark results of one trace & policy
+typedef struct __result {
+  size_t     nops;                ///< number of timed operations over all runs
+  size_t     nblocks;             ///< number of operations with bulk commands counted per block
+  double     time;                ///< accumulated time in the memory manager in seconds
+  long       *lat;                ///< per-operation latencies in nanoseconds
+  size_t     peak_heap;           ///< peak heap size
+  size_t     peak_live;           ///< peak live payload
+  ssize_t    nsbrk;               ///< number of sbrk() calls (last run)
+  ssize_t    nmprotect;           ///< number of mprotect() calls (last run)
+  ssize_t    nmadvise;            ///< number of madvise() calls (last run)
+  size_t     end_live;            ///< live payload at the end of the last run
+} Result;
+
+
+static int niter       = 10;      ///< number of runs per trace & policy
+static int do_check    = 0;       ///< run mm_check() on 'v' commands and verify payloads (yes: 1, otherwise 0)
+static int use_huge    = 0;       ///< back data segment with huge pages (yes: 1, otherwise 0)
+static int show_stats  = 0;       ///< print heap statistics (yes: 1, otherwise 0)
+static int free_sized  = 0;       ///< replay f with mm_free_sized() (yes: 1, otherwise 0)
+static char prof_file[256] = "";  ///< heap profile output file ("": profiler off)
+static unsigned long search_seen[3][MM_SEARCH_BINS]; ///< search length histograms already printed
+
+static const char *policy_name[] = { "first fit", "next fit", "best fit" };
+
+
+/// @brief print an error message and terminate
+static void die(const char *fmt, ...) __attribute__((format(printf, 1, 2), noreturn));
+static void die(const char *fmt, ...)
+{
+  va_list va;
+  va_start(va, fmt);
+  fprintf(stderr, "mm_bench: ");
+  vfprintf(stderr, fmt, va);
+  fprintf(stderr, "\n");
+  va_end(va);
+  exit(EXIT_FAILURE);
+}
+
+/// @brief load a .dmas script file
+/// @param fn file name
+/// @param[out] t trace
+static void load_trace(const char *fn, Trace *t)
+{
+  FILE *f = fopen(fn, "r");
+  if (f == NULL) die("cannot open '%s': %s", fn, strerror(errno));
+
+  size_t cap = 1024;
+  memset(t, 0, sizeof(*t));
+  t->name = fn;
+  t->dssize = 64*1024*1024;
+  t->op = malloc(cap * sizeof(Op));
+  if (t->op == NULL) die("out of memory");
+
+  char *line = NULL;
+  size_t llen = 0;
+  int lineno = 0;
+  while (getline(&line, &llen, f) > 0) {
+    char cmd[16];
+    lineno++;
+
+    if (sscanf(line, "%15s", cmd) != 1 || cmd[0] == '#') continue;
+
+    if (strcmp(cmd, "dataseg") == 0) {
+      if (sscanf(line, "%*s %li", &t->dssize) != 1) die("%s:%d: invalid dataseg size", fn, lineno);
+      continue;
+    }
+    if (strlen(cmd) != 1) continue;       // heap, mode, log, start, stop, stat
+
+    Op op = { .type = cmd[0], .id = 0, .size = 0, .align = 0, .count = 1 };
+    int ok;
+    switch (op.type) {
+      case 'm':
+      case 'c':
+      case 'r': ok = sscanf(line, "%*s %i %li", &op.id, &op.size) == 2; break;
+      case 'a': ok = (sscanf(line, "%*s %i %li %li", &op.id, &op.align, &op.size) == 3) &&
+                     (op.align > 0) && !(op.align & (op.align - 1)); break;
+      case 'f': ok = sscanf(line, "%*s %i", &op.id) == 1; break;
+      case 'M': ok = (sscanf(line, "%*s %i %i %li", &op.id, &op.count, &op.size) == 3) && (op.count > 0); break;
+      case 'F': ok = (sscanf(line, "%*s %i %i", &op.id, &op.count) == 2) && (op.count > 0); break;
+      case 'v': ok = 1; break;
+      default:  ok = 0;
+    }
+    if (!ok || (op.id < 0 && !(op.type == 'f' && op.id == -1))) die("%s:%d: invalid line '%s'", fn, lineno, strtok(line, "\n"));
+
+    if (t->nops == cap) {
+      cap *= 2;
+      t->op = realloc(t->op, cap * sizeof(Op));
+      if (t->op == NULL) die("out of memory");
+    }
+    t->op[t->nops++] = op;
+    if (op.id + op.count - 1 > t->maxid) t->maxid = op.id + op.count - 1;
+  }
+
+  free(line);
+  fclose(f);
+}
+
+/// @brief current time in nanoseconds
+static inline long now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+/// @brief fill bytes [@a from, @a to) of payload @a p of block @a id with the check pattern
+static void fill_payload(unsigned char *p, int id, size_t from, size_t to)
+{
+  for (size_t k = from; k < to; k++) p[k] = (unsigned char)(id * 31 + k);
+}
+
+/// @brief verify that payload @a p of block @a id holds the check pattern (@a zero = 0) or zeroes
+///        (@a zero = 1) in bytes [0, @a to)
+/// @retval size_t offset of the first wrong byte, @a to if there is none
+static size_t check_payload(const unsigned char *p, int id, size_t to, int zero)
+{
+  for (size_t k = 0; k < to; k++) {
+    if (p[k] != (zero ? 0 : (unsigned char)(id * 31 + k))) return k;
+  }
+  return to;
+}
+
+/// @brief replay trace @a t once with policy @a ap and accumulate the results in @a r
+static void run_trace(Trace *t, AllocationPolicy ap, Result *r)
+{
+  void **ptr = calloc(t->maxid + 1, sizeof(void*));
+  void **bulk = calloc(t->maxid + 1, sizeof(void*));
+  size_t *size = calloc(t->maxid + 1, sizeof(size_t));
+  char *aligned = calloc(t->maxid + 1, sizeof(char));
+  if ((ptr == NULL) || (bulk == NULL) || (size == NULL) || (aligned == NULL)) die("out of memory");
+
+  if (use_huge) ds_allocate_huge(t->dssize);
+  else ds_allocate(t->dssize);
+  mm_init(ap);
+
+  void *heap_start, *heap_brk;
+  ds_heap_stat(&heap_start, NULL, NULL);
+  size_t live = 0;
+
+  for (size_t i = 0; i < t->nops; i++) {
+    Op *op = &t->op[i];
+    void *p = (op->id >= 0) ? ptr[op->id] : NULL;
+    size_t n = op->count;
+
+    // Freed blocks must still hold their pattern
+    if (do_check && ((op->type == 'f') || (op->type == 'F')) && (op->id >= 0)) {
+      for (int id = op->id; id < op->id + op->count; id++) {
+        size_t k = ptr[id] ? check_payload(ptr[id], id, size[id], 0) : size[id];
+        if (k < size[id]) {
+          die("%s: %s: operation %c %d: payload of block %d corrupted at offset %lu of %lu", t->name,
+              policy_name[ap], op->type, op->id, id, k, size[id]);
+        }
+      }
+    }
+
+    // mm_free_bulk() reorders its argument
+    if (op->type == 'F') memcpy(bulk, &ptr[op->id], n * sizeof(void*));
+    int sized = free_sized && (op->type == 'f') && (op->id >= 0) && !aligned[op->id];
+
+    long start = now();
+
+    switch (op->type) {
+      case 'm': p = mm_malloc(op->size); break;
+      case 'c': p = mm_calloc(1, op->size); break;
+      case 'a': p = mm_memalign(op->align, op->size); break;
+      case 'r': p = mm_realloc(p, op->size); break;
+      case 'f': if (sized) mm_free_sized(p, size[op->id]); else mm_free(p); p = NULL; break;
+      case 'M': n = mm_malloc_bulk(op->size, n, bulk); p = n ? bulk[0] : NULL; break;
+      case 'F': mm_free_bulk(bulk, n); p = NULL; break;
+      case 'v': if (do_check) mm_check(); continue;
+    }
+
+    long lat = now() - start;
+    r->lat[r->nops++] = lat;
+    r->nblocks += op->count;
+    r->time += lat / 1e9;
+    ds_heap_stat(NULL, &heap_brk, NULL);
+    if ((size_t)(heap_brk - heap_start) > r->peak_heap) r->peak_heap = heap_brk - heap_start;
+
+    if ((p == NULL) && (op->type != 'f') && (op->type != 'F') && (op->size > 0)) {
+      die("%s: %s: operation %c %d %lu failed", t->name, policy_name[ap], op->type, op->id, op->size);
+    }
+    if ((op->type == 'a') && ((unsigned long)p & (op->align - 1))) {
+      die("%s: %s: operation a %d %lu %lu returned misaligned %p", t->name, policy_name[ap], op->id,
+          op->align, op->size, p);
+    }
+
+    if (n < (size_t)op->count) {
+      die("%s: %s: operation M %d %d %lu allocated only %lu blocks", t->name, policy_name[ap], op->id,
+          op->count, op->size, n);
+    }
+
+    if (op->id < 0) continue;
+
+    // New payloads get the pattern; calloc'ed ones must be zero, realloc'ed ones must keep it
+    if (do_check && (op->type != 'f') && (op->type != 'F')) {
+      for (int id = op->id; id < op->id + op->count; id++) {
+        void *q = (op->type == 'M') ? bulk[id - op->id] : p;
+        size_t keep = (op->type == 'c') ? op->size : 0;
+        if (op->type == 'r') keep = (size[id] < op->size) ? size[id] : op->size;
+        size_t k = (q != NULL) ? check_payload(q, id, keep, op->type == 'c') : keep;
+        if (k < keep) {
+          die("%s: %s: operation %c %d %lu: payload of block %d %s at offset %lu of %lu", t->name,
+              policy_name[ap], op->type, op->id, op->size, id,
+              (op->type == 'c') ? "not zero" : "not preserved", k, keep);
+        }
+        if (q != NULL) fill_payload(q, id, (op->type == 'c') ? 0 : keep, op->size);
+      }
+    }
+
+    // malloc/calloc on a live id leak the old block as in mm_driver
+    for (int id = op->id; id < op->id + op->count; id++) {
+      live -= (op->type == 'r' || op->type == 'f' || op->type == 'F') ? size[id] : 0;
+      size[id] = (op->type == 'f' || op->type == 'F') ? 0 : op->size;
+      live += size[id];
+      ptr[id] = (op->type == 'M') ? bulk[id - op->id] : (op->type == 'F') ? NULL : p;
+      aligned[id] = (op->type == 'a') || ((op->type == 'r') && aligned[id]);
+    }
+
+    if (live > r->peak_live) r->peak_live = live;
+  }
+
+  r->nsbrk = ds_getnsbrk();
+  r->nmprotect = ds_getnmprotect();
+  r->nmadvise = ds_getnmadvise();
+  r->end_live = live;
+
+  free(ptr);
+  free(bulk);
+  free(aligned);
+  free(size);
+}
+
+/// @brief write the heap profile to prof_file and compare the estimated live bytes (sum of the
+///        folded stacks' weights) to @a live
+static void dump_profile(size_t live)
+{
+  int n = mm_profile_dump(prof_file, pf_Folded);
+  if (n < 0) die("cannot write heap profile '%s'", prof_file);
+
+  FILE *f = fopen(prof_file, "r");
+  if (f == NULL) die("cannot read heap profile '%s'", prof_file);
+  double est = 0;
+  char *line = NULL, *w;
+  size_t llen = 0;
+  while (getline(&line, &llen, f) > 0) {
+    if ((w = strrchr(line, ' ')) != NULL) est += atof(w);
+  }
+  free(line);
+  fclose(f);
+
+  printf("  heap profile: %d samples, estimated live %.0f bytes, actual %lu (%+.1f%%)\n",
+         n, est, live, live ? 100.0 * (est - live) / live : 0.0);
+}
+
+/// @brief compare two latencies (for qsort)
+static int cmp_long(const void *a, const void *b)
+{
+  long x = *(const long*)a, y = *(const long*)b;
+  return (x > y) - (x < y);
+}
+
+/// @brief print usage and terminate
+static void usage(const char *prog)
+{
+  fprintf(stderr,
+    "Usage: %s [options] <trace.dmas>...\n"
+    "Options:\n"
+    "  -n <runs>      number of runs per trace and policy (default: %d)\n"
+    "  -p <policy>    ff, nf, bf (default: all policies)\n"
+    "  -a <bytes>     block alignment (16 or 32)\n"
+    "  -s             enable slab allocator\n"
+    "  -t             enable thread-safe mode\n"
+    "  -r             enable realloc slack\n"
+    "  -d             enable deferred coalescing\n"
+    "  -m             release free pages with madvise() instead of moving brk\n"
+    "  -T <high>:<low>:<decay>  heap trimming watermarks (bytes) and decay (operations)\n"
+    "  -C <min>:<max> bounds of the heap growth unit in bytes\n"
+    "  -H             back data segment with huge pages\n"
+    "  -E             eager mprotect() in ds_sbrk()\n"
+    "  -c             run mm_check() on 'v' commands and verify payloads\n"
+    "  -S             print heap statistics\n"
+    "  -z             replay f with mm_free_sized()\n"
+    "  -P <interval>:<file>  sample the heap profile every <interval> bytes, write it to <file>\n",
+    prog, niter);
+  exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+  int policy = -1, opt;
+  size_t high, low;
+  unsigned long decay;
+
+  while ((opt = getopt(argc, argv, "n:p:a:strdmT:C:HEcSzP:h")) != -1) {
+    switch (opt) {
+      case 'n': niter = atoi(optarg); if (niter < 1) usage(argv[0]); break;
+      case 'p':
+        if (strcmp(optarg, "ff") == 0) policy = ap_FirstFit;
+        else if (strcmp(optarg, "nf") == 0) policy = ap_NextFit;
+        else if (strcmp(optarg, "bf") == 0) policy = ap_BestFit;
+        else usage(argv[0]);
+        break;
+      case 'a': mm_setalignment(atoi(optarg)); break;
+      case 's': mm_setslab(1); break;
+      case 't': mm_setthreadsafe(1); break;
+      case 'r': mm_setreallocslack(1); break;
+      case 'd': mm_setdefercoalesce(1); break;
+      case 'm': mm_setmadvise(1); break;
+      case 'T':
+        if (sscanf(optarg, "%lu:%lu:%lu", &high, &low, &decay) != 3) usage(argv[0]);
+        mm_settrim(high, low, decay);
+        break;
+      case 'C':
+        if (sscanf(optarg, "%lu:%lu", &low, &high) != 2) usage(argv[0]);
+        mm_setchunksize(low, high);
+        break;
+      case 'H': use_huge = 1; break;
+      case 'E': ds_setlazymprotect(0); break;
+      case 'c': do_check = 1; break;
+      case 'S': show_stats = 1; break;
+      case 'z': free_sized = 1; break;
+      case 'P':
+        if (sscanf(optarg, "%lu:%255s", &high, prof_file) != 2) usage(argv[0]);
+        mm_setprofile(high);
+        break;
+      default:  usage(argv[0]);
+    }
+  }
+  if (optind >= argc) usage(argv[0]);
+
+  printf("%-24s %-9s %9s %10s %7s %7s %10s %10s %6s %6s %8s %7s\n",
+         "trace", "policy", "ops", "kops/sec", "p50 ns", "p99 ns",
+         "peak heap", "peak live", "util", "sbrk", "mprotect", "madvise");
+
+  for (int i = optind; i < argc; i++) {
+    Trace t;
+    load_trace(argv[i], &t);
+
+    for (int ap = ap_FirstFit; ap <= ap_BestFit; ap++) {
+      if ((policy >= 0) && (ap != policy)) continue;
+
+      Result r;
+      memset(&r, 0, sizeof(r));
+      r.lat = malloc(niter * t.nops * sizeof(long));
+      if (r.lat == NULL) die("out of memory");
+
+      for (int n = 0; n < niter; n++) run_trace(&t, ap, &r);
+
+      qsort(r.lat, r.nops, sizeof(long), cmp_long);
+      long p50 = r.nops ? r.lat[r.nops / 2] : 0;
+      long p99 = r.nops ? r.lat[r.nops * 99 / 100] : 0;
+
+      printf("%-24s %-9s %9lu %10.2f %7ld %7ld %10lu %10lu %5.1f%% %6ld %8ld %7ld\n",
+             t.name, policy_name[ap], r.nblocks, r.time > 0 ? r.nblocks / r.time / 1000 : 0.0,
+             p50, p99, r.peak_heap, r.peak_live,
+             r.peak_heap ? 100.0 * r.peak_live / r.peak_heap : 0.0, r.nsbrk, r.nmprotect, r.nmadvise);
+
+      if (prof_file[0] != '\0') dump_profile(r.end_live);
+
+      if (show_stats) {
+        MMStats after;
+        mm_stats(&after);
+        printf("  heap %lu, live %lu, free %lu (largest %lu, fragmentation %.1f%%), quick %lu\n",
+               after.heap_bytes, after.live_bytes, after.free_bytes, after.largest_free,
+               100.0 * after.fragmentation, after.quick_bytes);
+        printf("  splits %lu, coalesces %lu, grown %lu, trimmed %lu, zeroed callocs %lu\n",
+               after.nsplit, after.ncoalesce, after.ngrow, after.nshrink, after.nzero);
+        printf("  blocks visited per search:");
+        for (int b = 0; b < MM_SEARCH_BINS; b++) {
+          unsigned long n = after.search[ap][b] - search_seen[ap][b];
+          if (n == 0) continue;
+          if (b == 0) printf(" 0: %lu", n);
+          else if (b < MM_SEARCH_BINS-1) printf(" <%lu: %lu", 1UL << b, n);
+          else printf(" >=%lu: %lu", 1UL << (b-1), n);
+          search_seen[ap][b] = after.search[ap][b];
+        }
+        printf("\n");
+      }
+
+      free(r.lat);
+    }
+
+    free(t.op);
+  }
+
+  ds_release();
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,318 @@
+//--------------------------------------------------------------------------------------------------
+// System Programming                       Memory Lab                                    Fall 2023
+//
+/// @file
+/// @brief synthetic allocation trace generator
+/// @author Hyunwoo LEE
+/// @studid 2020-12907
+//--------------------------------------------------------------------------------------------------
+
+
+// Synthetic trace generator
+// =========================
+// mm_gentrace writes .dmas scripts (see mm_driver, mm_bench) from parameterized distributions:
+//
+// - sizes:      power-law (Pareto) distributed between a minimum and a maximum size. Optionally,
+//               a fraction of the requests is drawn from a list of peak sizes (e.g., the sizes of
+//               frequently allocated structures).
+// - lifetimes:  live blocks are freed in LIFO (stack-like), FIFO (queue-like), or random order.
+// - realloc:    a fraction of the allocations are buffers that subsequently grow through a chain
+//               of reallocs, interleaved with the other operations.
+// - phases:     the trace consists of bursts. In each burst, blocks are allocated and a few are
+//               freed; at the end of a burst, a large part of the live blocks is freed.
+//
+// The data segment size in the script is derived from the peak live payload. The generated
+// sequence depends only on the parameters and the seed.
+//
+
+#define _GNU_SOURCE
+
+#include <math.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+
+/// @brief lifetime orders
+typedef enum {
+  lt_LIFO,                        ///< free most recently allocated block first
+  lt_FIFO,                        ///< free least recently allocated block first
+  lt_Random,                      ///< free a random live block
+} Lifetime;
+
+/// @brief generated operation
+typedef struct __op {
+  char   type;                    ///< operation (m, r, f)
+  int    id;                      ///< block id
+  size_t size;                    ///< requested size in bytes
+} Op;
+
+
+//
+// parameters
+//
+static long     nalloc     = 10000;       ///< number of allocations (malloc)
+static double   alpha      = 1.2;         ///< power-law exponent of size distribution
+static size_t   minsize    = 8;           ///< minimal request size
+static size_t   maxsize    = 1<<16;       ///< maximal request size
+static size_t   peak[16];                 ///< peak sizes
+static int      npeak      = 0;           ///< number of peak sizes
+static double   peakprob   = 0.5;         ///< probability of drawing from the peak sizes
+static Lifetime lifetime   = lt_Random;   ///< lifetime order
+static double   freeprob   = 0.3;         ///< probability of a free after each allocation in a burst
+static double   bufprob    = 0.05;        ///< probability that an allocation starts a realloc chain
+static int      chainlen   = 8;           ///< maximal number of reallocs in a chain
+static double   growth     = 1.5;         ///< maximal growth factor of a realloc
+static int      nphases    = 10;          ///< number of bursts
+static double   phasefree  = 0.8;         ///< fraction of live blocks freed at the end of a burst
+static unsigned seed       = 1;           ///< random seed
+
+//
+// generator state
+//
+static Op     *op = NULL;                 ///< generated operations
+static size_t nops = 0, opcap = 0;        ///< number of operations, capacity
+static int    *live = NULL;               ///< ids of live blocks in allocation order
+static long   head = 0, tail = 0;         ///< live blocks are live[head..tail)
+static size_t *size = NULL;               ///< payload size per id (0: not live)
+static int    *chain = NULL;              ///< remaining reallocs per id
+static int    *freeid = NULL;             ///< stack of unused ids
+static int    nfreeid = 0;                ///< number of unused ids
+static int    *buf = NULL;                ///< ids of buffers with remaining reallocs
+static int    nbuf = 0;                   ///< number of buffers
+static size_t cur_live = 0, peak_live = 0; ///< current/peak live payload
+
+
+/// @brief print an error message and terminate
+static void die(const char *fmt, ...) __attribute__((format(printf, 1, 2), noreturn));
+static void die(const char *fmt, ...)
+{
+  va_list va;
+  va_start(va, fmt);
+  fprintf(stderr, "mm_gentrace: ");
+  vfprintf(stderr, fmt, va);
+  fprintf(stderr, "\n");
+  va_end(va);
+  exit(EXIT_FAILURE);
+}
+
+/// @brief uniformly distributed random number in [0, 1)
+static double uniform(void)
+{
+  return rand() / ((double)RAND_MAX + 1.0);
+}
+
+/// @brief draw a request size
+static size_t draw_size(void)
+{
+  if ((npeak > 0) && (uniform() < peakprob)) return peak[rand() % npeak];
+
+  // inverse transform sampling of the Pareto distribution, truncated at maxsize
+  double s = minsize * pow(1.0 - uniform(), -1.0 / alpha);
+  return (s > maxsize) ? maxsize : (size_t)s;
+}
+
+/// @brief append an operation
+static void emit(char type, int id, size_t sz)
+{
+  if (nops == opcap) {
+    opcap = opcap ? 2*opcap : 4096;
+    op = realloc(op, opcap * sizeof(Op));
+    if (op == NULL) die("out of memory");
+  }
+  op[nops++] = (Op){ .type = type, .id = id, .size = sz };
+}
+
+/// @brief allocate a block (possibly the start of a realloc chain)
+static void do_malloc(void)
+{
+  int id = freeid[--nfreeid];
+  size_t sz = draw_size();
+
+  emit('m', id, sz);
+  size[id] = sz;
+  cur_live += sz;
+  live[tail++] = id;
+
+  if (uniform() < bufprob) {
+    chain[id] = 1 + rand() % chainlen;
+    buf[nbuf++] = id;
+  }
+}
+
+/// @brief grow a random buffer by one realloc step
+static void do_realloc(void)
+{
+  while (nbuf > 0) {
+    int i = rand() % nbuf;
+    int id = buf[i];
+
+    // drop buffers that have been freed or completed their chain
+    if ((size[id] == 0) || (chain[id] == 0)) {
+      buf[i] = buf[--nbuf];
+      continue;
+    }
+
+    size_t sz = (size_t)(size[id] * (1.0 + (growth - 1.0) * uniform())) + 1;
+    emit('r', id, sz);
+    cur_live += sz - size[id];
+    size[id] = sz;
+    chain[id]--;
+    return;
+  }
+}
+
+/// @brief free a live block according to the lifetime order
+static void do_free(void)
+{
+  if (head == tail) return;
+
+  int id;
+  switch (lifetime) {
+    case lt_LIFO: id = live[--tail]; break;
+    case lt_FIFO: id = live[head++]; break;
+    default: {
+      long i = head + rand() % (tail - head);
+      id = live[i];
+      live[i] = live[--tail];
+    }
+  }
+
+  emit('f', id, 0);
+  cur_live -= size[id];
+  size[id] = 0;
+  chain[id] = 0;
+  freeid[nfreeid++] = id;
+}
+
+/// @brief print usage and terminate
+static void usage(const char *prog)
+{
+  fprintf(stderr,
+    "Usage: %s [options]\n"
+    "Options:\n"
+    "  -n <count>       number of allocations (default: %ld)\n"
+    "  -a <alpha>       power-law exponent of the size distribution (default: %.2f)\n"
+    "  -m <min>:<max>   size range in bytes (default: %lu:%lu)\n"
+    "  -k <s1,s2,...>   peak sizes (up to 16)\n"
+    "  -K <prob>        probability of drawing a peak size (default: %.2f)\n"
+    "  -l lifo|fifo|random  lifetime order (default: random)\n"
+    "  -f <prob>        probability of a free after an allocation (default: %.2f)\n"
+    "  -r <prob>        probability that an allocation starts a realloc chain (default: %.2f)\n"
+    "  -c <len>         maximal realloc chain length (default: %d)\n"
+    "  -g <factor>      maximal growth factor per realloc (default: %.2f)\n"
+    "  -p <count>       number of bursts (default: %d)\n"
+    "  -P <fraction>    fraction of live blocks freed after a burst (default: %.2f)\n"
+    "  -S <seed>        random seed (default: %u)\n"
+    "  -o <file>        output file (default: stdout)\n",
+    prog, nalloc, alpha, minsize, maxsize, peakprob, freeprob, bufprob, chainlen, growth,
+    nphases, phasefree, seed);
+  exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+  const char *outfn = NULL;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "n:a:m:k:K:l:f:r:c:g:p:P:S:o:h")) != -1) {
+    switch (opt) {
+      case 'n': nalloc = atol(optarg); break;
+      case 'a': alpha = atof(optarg); break;
+      case 'm': if (sscanf(optarg, "%lu:%lu", &minsize, &maxsize) != 2) usage(argv[0]); break;
+      case 'k':
+        // optarg is echoed into the trace header, so it must not be modified (no strtok())
+        for (char *t = optarg, *e; (*t != '\0') && (npeak < 16); t = e + (*e == ',')) {
+          peak[npeak++] = strtoul(t, &e, 0);
+          if ((e == t) || ((*e != ',') && (*e != '\0'))) usage(argv[0]);
+        }
+        break;
+      case 'K': peakprob = atof(optarg); break;
+      case 'l':
+        if (strcmp(optarg, "lifo") == 0) lifetime = lt_LIFO;
+        else if (strcmp(optarg, "fifo") == 0) lifetime = lt_FIFO;
+        else if (strcmp(optarg, "random") == 0) lifetime = lt_Random;
+        else usage(argv[0]);
+        break;
+      case 'f': freeprob = atof(optarg); break;
+      case 'r': bufprob = atof(optarg); break;
+      case 'c': chainlen = atoi(optarg); break;
+      case 'g': growth = atof(optarg); break;
+      case 'p': nphases = atoi(optarg); break;
+      case 'P': phasefree = atof(optarg); break;
+      case 'S': seed = strtoul(optarg, NULL, 0); break;
+      case 'o': outfn = optarg; break;
+      default:  usage(argv[0]);
+    }
+  }
+  if ((nalloc < 1) || (alpha <= 0) || (minsize < 1) || (maxsize < minsize) || (chainlen < 1) ||
+      (growth < 1.0) || (nphases < 1)) {
+    usage(argv[0]);
+  }
+
+  srand(seed);
+
+  live   = malloc(nalloc * sizeof(int));
+  size   = calloc(nalloc, sizeof(size_t));
+  chain  = calloc(nalloc, sizeof(int));
+  freeid = malloc(nalloc * sizeof(int));
+  buf    = malloc(nalloc * sizeof(int));
+  if (!live || !size || !chain || !freeid || !buf) die("out of memory");
+  for (long i = 0; i < nalloc; i++) freeid[nfreeid++] = nalloc - 1 - i;
+
+  //
+  // generate bursts
+  //
+  long done = 0;
+  for (int p = 0; p < nphases; p++) {
+    long n = nalloc * (p + 1) / nphases - done;
+
+    for (long i = 0; i < n; i++) {
+      // compact the live list when FIFO frees have consumed its front
+      if (tail == nalloc) {
+        memmove(live, &live[head], (tail - head) * sizeof(int));
+        tail -= head;
+        head = 0;
+      }
+      do_malloc();
+      if (cur_live > peak_live) peak_live = cur_live;
+      if ((nbuf > 0) && (uniform() < 0.5)) do_realloc();
+      if (cur_live > peak_live) peak_live = cur_live;
+      if (uniform() < freeprob) do_free();
+    }
+    done += n;
+
+    long nfree = (long)((tail - head) * phasefree);
+    while (nfree-- > 0) do_free();
+  }
+
+  //
+  // write script
+  //
+  FILE *f = stdout;
+  if ((outfn != NULL) && ((f = fopen(outfn, "w")) == NULL)) die("cannot open '%s'", outfn);
+
+  size_t dssize = 16*1024*1024;
+  while (dssize < 4*peak_live) dssize *= 2;
+
+  fprintf(f, "#\n# synthetic trace generated by\n#  ");
+  for (int i = 0; i < argc; i++) {
+    if ((i > 0) && (strcmp(argv[i-1], "-o") == 0)) continue;
+    if (strcmp(argv[i], "-o") != 0) fprintf(f, " %s", argv[i]);
+  }
+  fprintf(f, "\n#\n# %lu operations, peak live payload %lu bytes\n#\n\n", nops, peak_live);
+  fprintf(f, "dataseg 0x%lx\nheap firstfit\n\nmode performance\n\nlog ds 1\nlog mm 1\n\nstart\n\n", dssize);
+  for (size_t i = 0; i < nops; i++) {
+    if (op[i].type == 'f') fprintf(f, "f %d\n", op[i].id);
+    else fprintf(f, "%c %d %lu\n", op[i].type, op[i].id, op[i].size);
+  }
+  fprintf(f, "\nstop\nstat\n");
+
+  if (f != stdout) fclose(f);
+
+  free(op); free(live); free(size); free(chain); free(freeid); free(buf);
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,453 @@
+//--------------------------------------------------------------------------------------------------
+// System Programming                       Memory Lab                                    Fall 2023
+//
+/// @file
+/// @brief multi-threaded stress benchmark for the dynamic memory manager
+/// @author Hyunwoo LEE
+/// @studid 2020-12907
+//--------------------------------------------------------------------------------------------------
+
+
+// Multi-threaded benchmark
+// ========================
+// mm_mtbench runs multi-threaded workloads against memmgr.c in thread-safe mode and, as a
+// baseline, against the C library's malloc()/free(). Each workload is run with 1, 2, 4, ...
+// threads up to the number of online cores (or the number given with -t).
+//
+// Workloads:
+// - larson:   every thread owns an array of live blocks and replaces random entries with new
+//             blocks of random size. After each round, the arrays are passed on to the next
+//             thread, so most blocks are freed by a thread other than the one that allocated them
+//             (after Larson & Krishnan, "Memory allocation for long-running server applications").
+// - prodcons: every thread allocates blocks and hands them to the next thread through a single-
+//             producer/single-consumer ring; the next thread frees them.
+//
+// The threads synchronize only through atomic operations (mailboxes and rings); they never take
+// a lock outside of the allocator. Every block carries a tag that is checked when it is freed.
+//
+// Metrics:
+// - ops/sec:  (mallocs + frees) / wall-clock time from the start signal to the last thread done
+// - speedup:  ops/sec relative to one thread with the same allocator
+// - peak RSS: memmgr: largest number of resident bytes in the data segment (sampled with
+//             mincore() every RSS_INTERVAL ns and once at the end). libc: growth of the peak
+//             resident set of the process (VmHWM) over the resident set at the start of the run.
+//
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "dataseg.h"
+#include "memmgr.h"
+
+
+#define MIN(a, b)          ((a) < (b) ? (a) : (b))     ///< minimum of two values
+#define RING_SIZE          1024                        ///< capacity of a producer/consumer ring (power of 2)
+#define RSS_INTERVAL       10000000L                   ///< data segment RSS sampling interval in ns
+#define TAG(p, size)       ((uintptr_t)(p) ^ ((size) * 0x9e3779b97f4a7c15UL)) ///< tag stored in a block
+
+/// @brief workloads
+typedef enum {
+  wl_Larson,                      ///< cross-thread free by passing arrays of live blocks on
+  wl_ProdCons,                    ///< producer/consumer rings
+  wl_Count,
+} Workload;
+
+/// @brief allocators (the memmgr policies come first)
+typedef enum {
+  al_FirstFit = ap_FirstFit,      ///< memmgr, first fit
+  al_NextFit  = ap_NextFit,       ///< memmgr, next fit
+  al_BestFit  = ap_BestFit,       ///< memmgr, best fit
+  al_Libc,                        ///< C library malloc()/free()
+  al_Count,
+} Allocator;
+
+/// @brief live block
+typedef struct __block {
+  void       *ptr;                ///< payload (NULL: empty entry)
+  size_t     size;                ///< requested size in bytes
+} Block;
+
+/// @brief single-producer/single-consumer ring
+typedef struct __ring {
+  Block      slot[RING_SIZE];     ///< entries
+  size_t     head __attribute__((aligned(64)));  ///< next entry to read (consumer)
+  size_t     tail __attribute__((aligned(64)));  ///< next entry to write (producer)
+} Ring;
+
+/// @brief per-thread state
+typedef struct __worker {
+  pthread_t  thread;              ///< thread handle
+  int        id;                  ///< thread index
+  uint64_t   rng;                 ///< random number generator state
+  long       end;                 ///< time when the thread was done (ns)
+  size_t     nops;                ///< number of mallocs and frees
+  size_t     nerrors;             ///< number of failed mallocs and corrupted blocks
+} Worker;
+
+
+static const char *workload_name[] = { "larson", "prodcons" };
+static const char *allocator_name[] = { "first fit", "next fit", "best fit", "libc" };
+
+static int nthreads_max  = 0;     ///< largest number of threads (0: number of online cores)
+static size_t nops       = 1000000; ///< mallocs per thread
+static size_t nblocks    = 1000;  ///< live blocks per thread (larson)
+static size_t min_size   = 8;     ///< smallest request size
+static size_t max_size   = 512;   ///< largest request size
+static size_t dssize     = 1024UL*1024*1024; ///< data segment size for memmgr
+
+static void* (*do_malloc)(size_t) = NULL;       ///< malloc of the allocator under test
+static void  (*do_free)(void*)    = NULL;       ///< free of the allocator under test
+
+static int nthreads      = 0;     ///< number of threads of the current run
+static Workload workload;         ///< workload of the current run
+static int go            = 0;     ///< start signal
+static int ndone         = 0;     ///< number of threads done
+static Block **mailbox   = NULL;  ///< larson: array passed to thread i (NULL: empty)
+static Ring *ring        = NULL;  ///< prodcons: ring from thread i to thread i+1
+
+
+/// @brief print an error message and terminate
+static void die(const char *fmt, ...) __attribute__((format(printf, 1, 2), noreturn));
+static void die(const char *fmt, ...)
+{
+  va_list va;
+  va_start(va, fmt);
+  fprintf(stderr, "mm_mtbench: ");
+  vfprintf(stderr, fmt, va);
+  fprintf(stderr, "\n");
+  va_end(va);
+  exit(EXIT_FAILURE);
+}
+
+/// @brief monotonic time in nanoseconds
+static long now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+/// @brief next random number (xorshift64*)
+static uint64_t next_rand(Worker *w)
+{
+  w->rng ^= w->rng >> 12;
+  w->rng ^= w->rng << 25;
+  w->rng ^= w->rng >> 27;
+  return w->rng * 0x2545f4914f6cdd1dUL;
+}
+
+/// @brief allocate a block of random size and tag it
+/// @retval Block new block (ptr is NULL if the allocation failed)
+static Block block_alloc(Worker *w)
+{
+  Block b;
+  b.size = min_size + next_rand(w) % (max_size - min_size + 1);
+  b.ptr = do_malloc(b.size);
+  w->nops++;
+  if (b.ptr == NULL) w->nerrors++;
+  else *(uintptr_t*)b.ptr = TAG(b.ptr, b.size);
+  return b;
+}
+
+/// @brief check the tag of block @a b and free it
+static void block_free(Worker *w, Block *b)
+{
+  if (b->ptr == NULL) return;
+  if (*(uintptr_t*)b->ptr != TAG(b->ptr, b->size)) w->nerrors++;
+  do_free(b->ptr);
+  b->ptr = NULL;
+  w->nops++;
+}
+
+/// @brief larson workload: replace random blocks, pass the array on after each round
+static void run_larson(Worker *w)
+{
+  Block *blk = calloc(nblocks, sizeof(Block));
+  if (blk == NULL) die("out of memory");
+  Block **to = &mailbox[(w->id + 1) % nthreads];
+  Block **from = &mailbox[w->id];
+
+  size_t nmalloc = 0;
+  while (nmalloc < nops) {
+    for (size_t i = 0; (i < nblocks) && (nmalloc < nops); i++, nmalloc++) {
+      Block *b = &blk[next_rand(w) % nblocks];
+      block_free(w, b);
+      *b = block_alloc(w);
+    }
+
+    // Hand the array to the next thread and take the one of the previous thread
+    Block *expected = NULL;
+    while (!__atomic_compare_exchange_n(to, &expected, blk, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+      expected = NULL;
+      sched_yield();
+    }
+    while ((blk = __atomic_exchange_n(from, NULL, __ATOMIC_ACQUIRE)) == NULL) sched_yield();
+  }
+
+  // All threads run the same number of rounds, so the array taken last is not passed on again
+  for (size_t i = 0; i < nblocks; i++) block_free(w, &blk[i]);
+  free(blk);
+}
+
+/// @brief prodcons workload: allocate into the outgoing ring, free from the incoming ring
+static void run_prodcons(Worker *w)
+{
+  Ring *out = &ring[w->id];
+  Ring *in = &ring[(w->id + nthreads - 1) % nthreads];
+  size_t produced = 0, consumed = 0;
+
+  while ((produced < nops) || (consumed < nops)) {
+    int progress = 0;
+
+    size_t tail = out->tail;
+    if ((produced < nops) && (tail - __atomic_load_n(&out->head, __ATOMIC_ACQUIRE) < RING_SIZE)) {
+      out->slot[tail % RING_SIZE] = block_alloc(w);
+      __atomic_store_n(&out->tail, tail + 1, __ATOMIC_RELEASE);
+      produced++;
+      progress = 1;
+    }
+
+    size_t head = in->head;
+    if ((consumed < nops) && (head != __atomic_load_n(&in->tail, __ATOMIC_ACQUIRE))) {
+      Block b = in->slot[head % RING_SIZE];
+      __atomic_store_n(&in->head, head + 1, __ATOMIC_RELEASE);
+      block_free(w, &b);
+      consumed++;
+      progress = 1;
+    }
+
+    if (!progress) sched_yield();
+  }
+}
+
+/// @brief thread body: wait for the start signal, run the workload
+static void* worker(void *arg)
+{
+  Worker *w = arg;
+
+  while (!__atomic_load_n(&go, __ATOMIC_ACQUIRE)) sched_yield();
+
+  if (workload == wl_Larson) run_larson(w);
+  else run_prodcons(w);
+
+  w->end = now();
+  __atomic_add_fetch(&ndone, 1, __ATOMIC_RELEASE);
+  return NULL;
+}
+
+/// @brief number of resident bytes in the data segment
+static size_t ds_rss(unsigned char *vec)
+{
+  void *start, *end;
+  ds_heap_stat(&start, NULL, &end);
+
+  int pagesize = ds_getpagesize();
+  start = (void*)((uintptr_t)start & ~(uintptr_t)(pagesize - 1));
+  size_t npages = (end - start + pagesize - 1) / pagesize;
+  if (mincore(start, npages * pagesize, vec) != 0) die("mincore failed: %s", strerror(errno));
+
+  size_t n = 0;
+  for (size_t i = 0; i < npages; i++) n += vec[i] & 1;
+  return n * pagesize;
+}
+
+/// @brief read a field of /proc/self/status in KB
+static size_t proc_status(const char *field)
+{
+  FILE *f = fopen("/proc/self/status", "r");
+  if (f == NULL) return 0;
+
+  char line[256];
+  size_t kb = 0, len = strlen(field);
+  while (fgets(line, sizeof(line), f) != NULL) {
+    if ((strncmp(line, field, len) == 0) && (line[len] == ':')) {
+      kb = strtoul(line + len + 1, NULL, 10);
+      break;
+    }
+  }
+  fclose(f);
+  return kb;
+}
+
+/// @brief run workload @a wl with @a n threads on allocator @a al
+/// @param[out] ops number of mallocs and frees
+/// @param[out] rss peak RSS in bytes
+/// @retval double time in seconds
+static double run(Workload wl, Allocator al, int n, size_t *ops, size_t *rss)
+{
+  Worker *w = calloc(n, sizeof(Worker));
+  mailbox = calloc(n, sizeof(Block*));
+  ring = aligned_alloc(64, n * sizeof(Ring));
+  unsigned char *vec = NULL;
+  if ((w == NULL) || (mailbox == NULL) || (ring == NULL)) die("out of memory");
+  memset(ring, 0, n * sizeof(Ring));
+
+  workload = wl;
+  nthreads = n;
+  go = 0;
+  ndone = 0;
+
+  size_t rss_start = 0;
+  if (al == al_Libc) {
+    do_malloc = malloc;
+    do_free = free;
+    malloc_trim(0);
+    // Reset the peak RSS of the process (ignored if not supported)
+    FILE *f = fopen("/proc/self/clear_refs", "w");
+    if (f != NULL) {
+      fputs("5", f);
+      fclose(f);
+    }
+    rss_start = proc_status("VmRSS");
+  } else {
+    do_malloc = mm_malloc;
+    do_free = mm_free;
+    ds_allocate(dssize);
+    mm_init((AllocationPolicy)al);
+    vec = malloc(dssize / ds_getpagesize() + 2);
+    if (vec == NULL) die("out of memory");
+  }
+
+  for (int i = 0; i < n; i++) {
+    w[i].id = i;
+    w[i].rng = 0x9e3779b97f4a7c15UL * (i + 1);
+    if (pthread_create(&w[i].thread, NULL, worker, &w[i]) != 0) die("cannot create thread %d", i);
+  }
+
+  long start = now();
+  __atomic_store_n(&go, 1, __ATOMIC_RELEASE);
+
+  // Sample the data segment while the threads run
+  *rss = 0;
+  while ((vec != NULL) && (__atomic_load_n(&ndone, __ATOMIC_ACQUIRE) < n)) {
+    struct timespec ts = { 0, RSS_INTERVAL };
+    nanosleep(&ts, NULL);
+    size_t r = ds_rss(vec);
+    if (r > *rss) *rss = r;
+  }
+
+  long end = start;
+  *ops = 0;
+  size_t nerrors = 0;
+  for (int i = 0; i < n; i++) {
+    pthread_join(w[i].thread, NULL);
+    if (w[i].end > end) end = w[i].end;
+    *ops += w[i].nops;
+    nerrors += w[i].nerrors;
+  }
+  if (nerrors > 0) {
+    die("%s: %s: %d threads: %lu failed allocations or corrupted blocks", workload_name[wl],
+        allocator_name[al], n, nerrors);
+  }
+
+  if (vec != NULL) {
+    size_t r = ds_rss(vec);
+    if (r > *rss) *rss = r;
+    free(vec);
+  } else {
+    size_t hwm = proc_status("VmHWM");
+    *rss = (hwm > rss_start) ? (hwm - rss_start) * 1024 : 0;
+  }
+
+  free(w);
+  free(mailbox);
+  free(ring);
+
+  return (end - start) / 1e9;
+}
+
+/// @brief print usage and terminate
+static void usage(const char *prog)
+{
+  fprintf(stderr,
+    "Usage: %s [options]\n"
+    "Options:\n"
+    "  -t <threads>   largest number of threads (default: number of online cores)\n"
+    "  -n <ops>       mallocs per thread (default: %lu)\n"
+    "  -k <blocks>    live blocks per thread in the larson workload (default: %lu)\n"
+    "  -s <min>:<max> request sizes in bytes (default: %lu:%lu)\n"
+    "  -w <workload>  larson, prodcons (default: all workloads)\n"
+    "  -p <policy>    ff, nf, bf, libc (default: all policies and libc)\n"
+    "  -D <MB>        memmgr data segment size (default: %lu)\n"
+    "  -a <bytes>     block alignment (16 or 32)\n"
+    "  -S             enable slab allocator\n",
+    prog, nops, nblocks, min_size, max_size, dssize >> 20);
+  exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+  int only_wl = -1, only_al = -1, opt;
+
+  while ((opt = getopt(argc, argv, "t:n:k:s:w:p:D:a:Sh")) != -1) {
+    switch (opt) {
+      case 't': nthreads_max = atoi(optarg); if (nthreads_max < 1) usage(argv[0]); break;
+      case 'n': nops = strtoul(optarg, NULL, 0); if (nops < 1) usage(argv[0]); break;
+      case 'k': nblocks = strtoul(optarg, NULL, 0); if (nblocks < 1) usage(argv[0]); break;
+      case 's':
+        if ((sscanf(optarg, "%lu:%lu", &min_size, &max_size) != 2) ||
+            (min_size < sizeof(uintptr_t)) || (max_size < min_size)) usage(argv[0]);
+        break;
+      case 'w':
+        for (only_wl = 0; (only_wl < wl_Count) && strcmp(optarg, workload_name[only_wl]); only_wl++);
+        if (only_wl == wl_Count) usage(argv[0]);
+        break;
+      case 'p':
+        if (strcmp(optarg, "ff") == 0) only_al = al_FirstFit;
+        else if (strcmp(optarg, "nf") == 0) only_al = al_NextFit;
+        else if (strcmp(optarg, "bf") == 0) only_al = al_BestFit;
+        else if (strcmp(optarg, "libc") == 0) only_al = al_Libc;
+        else usage(argv[0]);
+        break;
+      case 'D': dssize = strtoul(optarg, NULL, 0) << 20; if (dssize == 0) usage(argv[0]); break;
+      case 'a': mm_setalignment(atoi(optarg)); break;
+      case 'S': mm_setslab(1); break;
+      default:  usage(argv[0]);
+    }
+  }
+  if (optind < argc) usage(argv[0]);
+  if (nthreads_max == 0) nthreads_max = sysconf(_SC_NPROCESSORS_ONLN);
+  if (nthreads_max < 1) nthreads_max = 1;
+
+  mm_setthreadsafe(1);
+
+  printf("%-9s %-9s %7s %10s %10s %8s %10s\n",
+         "workload", "allocator", "threads", "ops", "kops/sec", "speedup", "peak RSS");
+
+  for (int wl = 0; wl < wl_Count; wl++) {
+    if ((only_wl >= 0) && (wl != only_wl)) continue;
+
+    for (int al = 0; al < al_Count; al++) {
+      if ((only_al >= 0) && (al != only_al)) continue;
+
+      double base = 0;
+      // 1, 2, 4, ... threads and nthreads_max
+      for (int n = 1; n <= nthreads_max; n = (n < nthreads_max) ? MIN(2 * n, nthreads_max) : n + 1) {
+        size_t ops, rss;
+        double t = run(wl, al, n, &ops, &rss);
+        double kops = t > 0 ? ops / t / 1000 : 0.0;
+        if (n == 1) base = kops;
+
+        printf("%-9s %-9s %7d %10lu %10.2f %7.2fx %8lu KB\n", workload_name[wl], allocator_name[al], n,
+               ops, kops, base > 0 ? kops / base : 0.0, rss >> 10);
+        fflush(stdout);
+      }
+    }
+  }
+
+  ds_release();
+
+  return EXIT_SUCCESS;
+}